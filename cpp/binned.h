@@ -0,0 +1,308 @@
+/** @file binned.h
+ *  @brief The features of a dataset quantized by the splitting class. Only
+ *         which threshold interval a row's attribute sum falls in matters
+ *         to the threshold splits of a group (see ThresholdGroup), so each
+ *         row keeps one bin index per group, a byte wide for groups of up
+ *         to 255 thresholds and two bytes otherwise. Single-column groups
+ *         over a one-hot block (see findOneHotBlocks) share one field
+ *         instead, the block's hot column. Counting a field is then a byte
+ *         histogram, and a split is a comparison of bins.
+ */
+
+#ifndef D3T_BINNED_H
+#define D3T_BINNED_H
+
+#include "counts.h"
+#include "dataset.h"
+#include "histogram.h"
+#include "split.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Per row of a dataset, the bin of every field. A field is either one
+ * ThresholdGroup of the splitting class, or a one-hot block whose bin k
+ * means column k of the block is 1, and whose last bin means none is. Bin b
+ * of row r stands for row r of the dataset the bins were built from.
+ */
+class BinnedFeatures {
+public:
+    BinnedFeatures(const Dataset& data,
+                   const std::vector<std::shared_ptr<Split>>& splittingClass)
+        : numRows(data.numRows),
+          numSplits(splittingClass.size()),
+          splitGroups_(splittingClass)
+    {
+        std::vector<int> columns;
+        std::unordered_map<int, int> column2group;
+        for (size_t g = 0; g < splitGroups_.groups.size(); g++) {
+            const std::vector<int>& attributes = splitGroups_.groups[g].attributes;
+            if (attributes.size() == 1) {
+                columns.push_back(attributes[0]);
+                column2group.insert({attributes[0], (int)g});
+            }
+        }
+        std::sort(columns.begin(), columns.end());
+        std::vector<bool> inBlock(splitGroups_.groups.size(), false);
+        for (const std::vector<int>& block : findOneHotBlocks(data, columns)) {
+            std::vector<int> groups;
+            for (int c : block) {
+                groups.push_back(column2group[c]);
+                inBlock[groups.back()] = true;
+            }
+            addOneHotField(data, block, groups);
+        }
+        for (size_t g = 0; g < splitGroups_.groups.size(); g++) {
+            if (!inBlock[g]) {
+                addThresholdField(data, (int)g);
+            }
+        }
+
+        splits_.assign(numSplits, BinnedSplit{-1, 0, 0, 0});
+        for (size_t f = 0; f < fields_.size(); f++) {
+            const BinnedField& field = fields_[f];
+            for (size_t k = 0; k < field.groups.size(); k++) {
+                const ThresholdGroup& group = splitGroups_.groups[field.groups[k]];
+                for (size_t i = 0; i < group.splitIdxs.size(); i++) {
+                    int rank = group.thresholdRanks[i];
+                    BinnedSplit& split = splits_[group.splitIdxs[i]];
+                    split.field = (int)f;
+                    if (field.oneHot) {
+                        split.rank = (int)k;
+                        split.hotBranch = group.bin(1.0f) <= rank;
+                        split.coldBranch = group.bin(0.0f) <= rank;
+                    }
+                    else {
+                        split.rank = rank;
+                    }
+                }
+            }
+        }
+        INFO_PRINTF("Binned %zu rows in %zu fields, %zu of them one-hot blocks (%zu KB)\n",
+                    numRows, fields_.size(), numOneHotFields(), bytes() / 1024);
+    }
+
+    size_t numFields() const
+    {
+        return fields_.size();
+    }
+
+    size_t numOneHotFields() const
+    {
+        size_t result = 0;
+        for (const BinnedField& field : fields_) {
+            result += field.oneHot;
+        }
+        return result;
+    }
+
+    int numBins(size_t f) const
+    {
+        return fields_[f].numBins;
+    }
+
+    size_t bytes() const
+    {
+        size_t result = 0;
+        for (const BinnedField& field : fields_) {
+            result += field.bins8.size() + field.bins16.size() * sizeof(uint16_t);
+        }
+        return result;
+    }
+
+    /*
+     * Adds rows[0..n), whose labels are labels[0..n), to hist, the
+     * [bin][label] histogram of field f.
+     */
+    void accumulate(size_t f,
+                    const int* rows,
+                    const int* labels,
+                    size_t n,
+                    int numLabels,
+                    int* hist) const
+    {
+        const BinnedField& field = fields_[f];
+        if (!field.bins8.empty()) {
+            accumulate(field.bins8.data(), rows, labels, n, numLabels, hist);
+        }
+        else {
+            accumulate(field.bins16.data(), rows, labels, n, numLabels, hist);
+        }
+    }
+
+    /*
+     * Writes the [branch][label] counts of every split of field f into
+     * tensor, whose split indices are those of the splitting class, from the
+     * field's histogram hist. A one-hot block gives the counts of all its
+     * columns' splits from one histogram.
+     */
+    void fillTensor(size_t f, const int* hist, int numLabels, CountTensor& tensor) const
+    {
+        const BinnedField& field = fields_[f];
+        if (!field.oneHot) {
+            splitGroups_.groups[field.groups[0]].fillTensor(hist, numLabels, tensor);
+            return;
+        }
+        std::vector<int> total(numLabels, 0);
+        for (int b = 0; b < field.numBins; b++) {
+            for (int label = 0; label < numLabels; label++) {
+                total[label] += hist[b * numLabels + label];
+            }
+        }
+        for (int g : field.groups) {
+            for (int splitIdx : splitGroups_.groups[g].splitIdxs) {
+                const BinnedSplit& split = splits_[splitIdx];
+                for (int label = 0; label < numLabels; label++) {
+                    int numHot = hist[split.rank * numLabels + label];
+                    tensor.at(splitIdx, 0, label) = 0;
+                    tensor.at(splitIdx, 1, label) = 0;
+                    tensor.at(splitIdx, split.hotBranch, label) += numHot;
+                    tensor.at(splitIdx, split.coldBranch, label) += total[label] - numHot;
+                }
+            }
+        }
+    }
+
+    // whether splittingClass[splitIdx] is a split of some field
+    bool binned(int splitIdx) const
+    {
+        return splits_[splitIdx].field >= 0;
+    }
+
+    /*
+     * Writes the branch of splittingClass[splitIdx], which is binned, for
+     * each of rows[0..n) to out.
+     */
+    void applySplit(int splitIdx, const int* rows, size_t n, uint8_t* out) const
+    {
+        const BinnedSplit& split = splits_[splitIdx];
+        const BinnedField& field = fields_[split.field];
+        if (field.oneHot) {
+            const uint8_t* bins = field.bins8.data();
+            for (size_t j = 0; j < n; j++) {
+                out[j] = bins[rows[j]] == split.rank ? split.hotBranch : split.coldBranch;
+            }
+        }
+        else if (!field.bins8.empty()) {
+            applySplit(field.bins8.data(), split.rank, rows, n, out);
+        }
+        else {
+            applySplit(field.bins16.data(), split.rank, rows, n, out);
+        }
+    }
+
+    const size_t numRows;
+    const size_t numSplits;
+
+private:
+    class BinnedField {
+    public:
+        bool oneHot;
+        int numBins;
+        // the group counted from the field, or, for a one-hot block, the
+        // group of each of its columns in order
+        std::vector<int> groups;
+        // the bins of all rows in the one of the two that fits
+        std::vector<uint8_t> bins8;
+        std::vector<uint16_t> bins16;
+    };
+
+    class BinnedSplit {
+    public:
+        // -1 if the split is not binned
+        int field;
+        // threshold fields: the rows of bins <= rank go to branch 1;
+        // one-hot fields: the column of the block the split reads
+        int rank;
+        // one-hot fields: the branch of rows hot in that column, and of the rest
+        uint8_t hotBranch;
+        uint8_t coldBranch;
+    };
+
+    void addThresholdField(const Dataset& data, int g)
+    {
+        const ThresholdGroup& group = splitGroups_.groups[g];
+        assert(group.numBins() - 1 <= std::numeric_limits<uint16_t>::max());
+        bool narrow = group.numBins() - 1 <= std::numeric_limits<uint8_t>::max();
+        fields_.push_back(BinnedField{false, group.numBins(), {g}, {}, {}});
+        BinnedField& field = fields_.back();
+        if (narrow) {
+            field.bins8.resize(numRows);
+        }
+        else {
+            field.bins16.resize(numRows);
+        }
+        std::vector<const float*> columns;
+        for (int attr : group.attributes) {
+            columns.push_back(data.column(attr));
+        }
+        for (size_t r = 0; r < numRows; r++) {
+            // same summation order as ThresholdGroup::accumulate
+            float sum = 0.0;
+            for (const float* column : columns) {
+                sum += column[r];
+            }
+            int bin = group.bin(sum);
+            if (narrow) {
+                field.bins8[r] = (uint8_t)bin;
+            }
+            else {
+                field.bins16[r] = (uint16_t)bin;
+            }
+        }
+    }
+
+    void addOneHotField(const Dataset& data,
+                        const std::vector<int>& block,
+                        const std::vector<int>& groups)
+    {
+        assert(block.size() <= ONE_HOT_MAX_COLUMNS);
+        fields_.push_back(BinnedField{true, (int)block.size() + 1, groups, {}, {}});
+        BinnedField& field = fields_.back();
+        // rows hot in no column of the block
+        field.bins8.assign(numRows, (uint8_t)block.size());
+        for (size_t k = 0; k < block.size(); k++) {
+            const float* column = data.column(block[k]);
+            for (size_t r = 0; r < numRows; r++) {
+                if (column[r] == 1.0f) {
+                    field.bins8[r] = (uint8_t)k;
+                }
+            }
+        }
+    }
+
+    template <typename Bin>
+    static void accumulate(const Bin* bins,
+                           const int* rows,
+                           const int* labels,
+                           size_t n,
+                           int numLabels,
+                           int* hist)
+    {
+        for (size_t j = 0; j < n; j++) {
+            hist[bins[rows[j]] * numLabels + labels[j]]++;
+        }
+    }
+
+    template <typename Bin>
+    static void applySplit(const Bin* bins, int rank, const int* rows, size_t n, uint8_t* out)
+    {
+        for (size_t j = 0; j < n; j++) {
+            out[j] = bins[rows[j]] <= rank;
+        }
+    }
+
+    SplitGroups splitGroups_;
+    std::vector<BinnedField> fields_;
+    // splits_[i] locates splittingClass[i]
+    std::vector<BinnedSplit> splits_;
+};
+
+#endif // D3T_BINNED_H
@@ -0,0 +1,151 @@
+/** @file bitmap.h
+ *  @brief Outcomes of a fixed splitting class on every row of a dataset,
+ *         evaluated once and stored as bit vectors, so that counting a node
+ *         becomes AND + popcount over its membership words.
+ */
+
+#ifndef D3T_BITMAP_H
+#define D3T_BITMAP_H
+
+#include "counts.h"
+#include "dataset.h"
+#include "split.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+constexpr size_t BITS_PER_WORD = 64;
+
+/*
+ * For each split, one bitmap per branch except branch 0 (its rows are the
+ * ones in no other branch), and one bitmap per label. Bit r stands for row r
+ * of the dataset the bitmaps were built from.
+ */
+class SplitBitmaps {
+public:
+    SplitBitmaps(const Dataset& data,
+                 const std::vector<std::shared_ptr<Split>>& splittingClass,
+                 int numLabels)
+        : numRows(data.numRows),
+          numWords((data.numRows + BITS_PER_WORD - 1) / BITS_PER_WORD),
+          numSplits((int)splittingClass.size()),
+          numBranches(1),
+          numLabels(numLabels)
+    {
+        for (const std::shared_ptr<Split>& splitFn : splittingClass) {
+            numBranches = std::max(numBranches, splitBranches(splitFn));
+        }
+        branchBits_.assign((size_t)numSplits * (numBranches - 1) * numWords, 0);
+        labelBits_.assign((size_t)numLabels * numWords, 0);
+
+        for (size_t r = 0; r < numRows; r++) {
+            uint64_t bit = (uint64_t)1 << (r % BITS_PER_WORD);
+            assert(data.label(r) >= 0 && data.label(r) < numLabels);
+            labelBits_[data.label(r) * numWords + r / BITS_PER_WORD] |= bit;
+        }
+        std::vector<int> rows(numRows);
+        for (size_t r = 0; r < numRows; r++) {
+            rows[r] = (int)r;
+        }
+        std::vector<uint8_t> branches(numRows);
+        for (int s = 0; s < numSplits; s++) {
+            splittingClass[s]->applySplitBatch(data, rows.data(), numRows, branches.data());
+            for (size_t r = 0; r < numRows; r++) {
+                assert(branches[r] < numBranches);
+                if (branches[r] > 0) {
+                    branchBits_[offset(s, branches[r]) + r / BITS_PER_WORD] |=
+                        (uint64_t)1 << (r % BITS_PER_WORD);
+                }
+            }
+        }
+        INFO_PRINTF("Precomputed %d split bitmaps over %zu rows (%zu KB)\n", numSplits,
+                    numRows, (branchBits_.size() + labelBits_.size()) * sizeof(uint64_t) / 1024);
+    }
+
+    // only for branch >= 1
+    const uint64_t* branch(int split, int b) const
+    {
+        return branchBits_.data() + offset(split, b);
+    }
+
+    const uint64_t* label(int l) const
+    {
+        return labelBits_.data() + (size_t)l * numWords;
+    }
+
+    /*
+     * Counts splits (indices into the splitting class) over the rows
+     * rowIdxs[i] for i < n, which must be increasing.
+     */
+    CountTensor countTensor(const int* rowIdxs,
+                            size_t n,
+                            const std::vector<int>& splits) const
+    {
+        // membership of the node as its non-zero words
+        std::vector<size_t> wordIdxs;
+        std::vector<uint64_t> memberWords;
+        for (size_t i = 0; i < n; i++) {
+            size_t row = rowIdxs[i];
+            assert(row < numRows);
+            size_t word = row / BITS_PER_WORD;
+            assert(wordIdxs.empty() || wordIdxs.back() <= word);
+            if (wordIdxs.empty() || wordIdxs.back() != word) {
+                wordIdxs.push_back(word);
+                memberWords.push_back(0);
+            }
+            memberWords.back() |= (uint64_t)1 << (row % BITS_PER_WORD);
+        }
+
+        // node membership AND each label
+        size_t numMemberWords = wordIdxs.size();
+        std::vector<uint64_t> nodeLabelWords((size_t)numLabels * numMemberWords);
+        std::vector<int> labelTotals(numLabels, 0);
+        for (int l = 0; l < numLabels; l++) {
+            const uint64_t* labelWords = label(l);
+            uint64_t* out = nodeLabelWords.data() + (size_t)l * numMemberWords;
+            for (size_t k = 0; k < numMemberWords; k++) {
+                out[k] = memberWords[k] & labelWords[wordIdxs[k]];
+                labelTotals[l] += __builtin_popcountll(out[k]);
+            }
+        }
+
+        CountTensor tensor((int)splits.size(), numBranches, numLabels);
+        for (size_t i = 0; i < splits.size(); i++) {
+            for (int l = 0; l < numLabels; l++) {
+                const uint64_t* nodeLabel = nodeLabelWords.data() + (size_t)l * numMemberWords;
+                int rest = labelTotals[l];
+                for (int b = 1; b < numBranches; b++) {
+                    const uint64_t* branchWords = branch(splits[i], b);
+                    int count = 0;
+                    for (size_t k = 0; k < numMemberWords; k++) {
+                        count += __builtin_popcountll(nodeLabel[k] & branchWords[wordIdxs[k]]);
+                    }
+                    tensor.at((int)i, b, l) = count;
+                    rest -= count;
+                }
+                tensor.at((int)i, 0, l) = rest;
+            }
+        }
+        return tensor;
+    }
+
+    const size_t numRows;
+    const size_t numWords;
+    const int numSplits;
+    int numBranches;
+    const int numLabels;
+
+private:
+    size_t offset(int split, int b) const
+    {
+        assert(split >= 0 && split < numSplits && b >= 1 && b < numBranches);
+        return ((size_t)split * (numBranches - 1) + (b - 1)) * numWords;
+    }
+
+    std::vector<uint64_t> branchBits_;
+    std::vector<uint64_t> labelBits_;
+};
+
+#endif // D3T_BITMAP_H
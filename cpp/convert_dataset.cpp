@@ -0,0 +1,44 @@
+/** @file convert_dataset.cpp
+ *  @brief Converts a protobuf dataset into a dataset file (see
+ *         dataset_file.h), which single_run and entity_server then map
+ *         instead of parsing the protobuf file whenever it sits next to it.
+ *
+ *         usage: convert_dataset <protobuf file> [<output> [row|col|both]]
+ */
+
+#include "dataset_file.h"
+
+int main(int argc, char* argv[])
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    if (argc < 2) {
+        printf("usage: %s <protobuf file> [<output> [row|col|both]]\n", argv[0]);
+        return 1;
+    }
+    std::string input(argv[1]);
+    std::string output = argc > 2 ? std::string(argv[2]) : input + DATASET_FILE_SUFFIX;
+    std::string layout = argc > 3 ? std::string(argv[3]) : "both";
+    uint32_t layouts;
+    if (layout == "row") {
+        layouts = DATASET_FILE_ROW_MAJOR;
+    }
+    else if (layout == "col") {
+        layouts = DATASET_FILE_COL_MAJOR;
+    }
+    else if (layout == "both") {
+        layouts = DATASET_FILE_ROW_MAJOR | DATASET_FILE_COL_MAJOR;
+    }
+    else {
+        printf("layout must be row, col or both, not %s\n", layout.c_str());
+        return 1;
+    }
+
+    // all rows in file order; runs sample their rows from the mapped file
+    Dataset data;
+    size_t numLabels = parseProtobuf(data, input, 0, 1.0, false);
+    if (numLabels == 0 || !writeDatasetFile(data, numLabels, layouts, output)) {
+        return 1;
+    }
+    printf("Wrote %zu x %zu data to %s\n", data.numRows, data.numCols, output.c_str());
+    return 0;
+}
@@ -1,19 +1,23 @@
 /** @file coordinator.h
  *  @brief Central coordinator for distributed decision tree learning. 
  *         Uses results from entity queries to build a decision tree.
- *         Here, entities are just represented as objects. The queries can be
- *         easily extended to RPC calls for a distributed version.
+ *         Entities are queried through EntityInterface, either as objects in
+ *         this process or over RPC (see remote_entity.h).
  */
 #ifndef D3T_COORDINATOR_H
 #define D3T_COORDINATOR_H
 
 #include "entity.h"
 #include "split.h"
+#include "thread_pool.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <ctime>
+#include <limits>
 #include <memory>
 #include <queue>
+#include <string>
 #include <unordered_map>
 
 class CoordinatorNode {
@@ -33,6 +37,7 @@ public:
 
     // if not leaf
     std::shared_ptr<Split> splitFn;
+    SplitKernel splitKernel;
     std::unordered_map<int, std::shared_ptr<CoordinatorNode>> children;
 };
 
@@ -58,6 +63,31 @@ public:
     }
 };
 
+class CoordinatorOptions {
+public:
+    // threads for entity queries, counting the coordinator's own; 0 for one
+    // per hardware thread
+    int numThreads = 1;
+    // sum the split totals from the noised (split, branch, label) counts
+    // instead of noising them separately, see privateSplit; changes the
+    // results
+    bool splitCountsFromLabelCounts = false;
+    // count the children of an expanded leaf at all entities at once before
+    // querying them one by one, see Entity::prefetchChildren
+    bool prefetchChildren = false;
+    // where the entities run: empty for this process, "fork" for a child
+    // process each, or comma-separated entity_server addresses, see
+    // performTest
+    std::string entityServers;
+    // grow the tree a depth at a time, see trainLevelWise; changes the
+    // results, as leaves are expanded in another order
+    bool levelWise = false;
+    // the entities draw counter-based noise (EntityOptions::counterNoise),
+    // which does not depend on the order of queries, so the children of an
+    // expanded leaf are queried concurrently, see train
+    bool counterNoise = false;
+};
+
 class Coordinator {
 public:
     Coordinator(float leafPrivacyFraction,
@@ -67,9 +97,10 @@ public:
                 std::string budgetFn,
                 std::string algo,
                 int numDatapoints,
-                std::vector<Entity> entities,
+                std::vector<std::shared_ptr<EntityInterface>> entities,
                 std::vector<std::shared_ptr<Split>> splittingClass,
-                std::shared_ptr<SplittingCriterion> splittingCriterion)
+                std::shared_ptr<SplittingCriterion> splittingCriterion,
+                const CoordinatorOptions& options = CoordinatorOptions())
         : leafPrivacyFraction(leafPrivacyFraction),
           maxNumNodes(maxNumNodes),
           maxDepth(maxDepth),
@@ -79,19 +110,27 @@ public:
           numDataPoints(numDatapoints),
           entities(std::move(entities)),
           splittingClass(std::move(splittingClass)),
-          splittingCriterion(std::move(splittingCriterion))
+          splittingCriterion(std::move(splittingCriterion)),
+          options(options),
+          pool_(std::make_shared<ThreadPool>(options.numThreads))
     {
+        // entities queried on their own, as in singleMachine, scan large
+        // nodes on the pool
+        for (const std::shared_ptr<EntityInterface>& entity : Coordinator::entities) {
+            entity->setThreadPool(pool_);
+        }
         INFO_PRINTF(
             "Initialized Coordinator(maxNumNodes=%d, eps=%f, budgetFn=%s, "
-            "algo=%s, numDatapoints=%d, %zu entities, %zu splitting class, and "
-            "criterion)\n",
+            "algo=%s, numDatapoints=%d, %zu entities, %zu splitting class, "
+            "criterion, and %d threads)\n",
             maxNumNodes, eps, Coordinator::budgetFn.c_str(),
             Coordinator::algo.c_str(), numDatapoints,
-            Coordinator::entities.size(), Coordinator::splittingClass.size());
+            Coordinator::entities.size(), Coordinator::splittingClass.size(),
+            pool_->numThreads());
     }
 
     // leaf budget for internal nodes
-    float leafBudget(float depth)
+    float leafBudget(float depth) const
     {
         assert(depth < maxDepth);
         if (budgetFn == "uniform") {
@@ -118,6 +157,10 @@ public:
     // (root, numNodes, maxDepth)
     std::tuple<std::shared_ptr<CoordinatorNode>, int, int> train(float alpha)
     {
+        if (options.levelWise) {
+            return trainLevelWise(alpha);
+        }
+
         std::shared_ptr<Split> splitFnHat;
         float Jhat;
         std::priority_queue<QueueDataType, std::vector<QueueDataType>, WeightLessThan> Q;
@@ -137,100 +180,138 @@ public:
             if (Q.empty())
                 break;
             std::shared_ptr<CoordinatorNode> bestLeaf = Q.top().leaf;
-            bestLeaf->splitFn = Q.top().splitFn;
-            assert(bestLeaf->isLeaf);
-            bestLeaf->isLeaf = false;
-#if defined(DEBUG) && DEBUG > 1
-            int workedTotal = std::round(totalCountAcrossEntities(bestLeaf->id, INT_MAX));
-#endif
-            DEBUG_PRINTF(
-                "Node: %d\tweight: %f\tpriority: %f\tdepth: %d\twith "
-                "%d/%d\tSplitFn %d (%s)\n",
-                bestLeaf->id, bestLeaf->weight, Q.top().priority,
-                bestLeaf->depth, workedTotal, numDataPoints,
-                bestLeaf->splitFn->id, bestLeaf->splitFn->toString().c_str());
+            DEBUG_PRINTF("Priority: %f\n", Q.top().priority);
+            expandLeaf(bestLeaf, Q.top().splitFn);
             Q.pop();
-
-            // tell entities to split the leaf with split function
-            for (size_t i = 0; i < entities.size(); i++) {
-                entities[i].splitLeafWithFn(bestLeaf->id, bestLeaf->splitFn);
+            if (options.prefetchChildren && bestLeaf->depth + 1 < maxDepth) {
+                pool_->parallelFor(entities.size(), [&](size_t i) {
+                    entities[i]->prefetchChildren(bestLeaf->id);
+                });
             }
 
-            // for each child, perform a private split
+            // for each child, perform a private split; with sequential noise
+            // every draw depends on the ones before, so the children are
+            // queried one at a time, in branch order
+            std::vector<std::shared_ptr<CoordinatorNode>> children;
             for (size_t i = 0; i < bestLeaf->splitFn->labels.size(); i++) {
-                std::shared_ptr<CoordinatorNode> child = std::make_shared<CoordinatorNode>(
-                    (int)id2node_.size(), bestLeaf->depth + 1);
-                bestLeaf->children.insert({bestLeaf->splitFn->labels[i], child});
-                id2node_.push_back(child);
-                if (child->depth >= maxDepth) {
-                    continue; // depth of internal node goes up to maxDepth-1
+                children.push_back(addChild(bestLeaf, i));
+            }
+            std::vector<float> totals(children.size());
+            std::vector<std::tuple<std::shared_ptr<Split>, float>> splits(children.size());
+            auto splitChild = [&](size_t i) {
+                totals[i] = childTotal(children[i], splitsAlpha);
+                if (!std::isnan(totals[i])) {
+                    float leafAlpha = splitsAlpha * leafBudget(children[i]->depth);
+                    splits[i] = privateSplit(children[i], totals[i], 2 * leafAlpha / 3);
                 }
-
-                float leafAlpha = splitsAlpha * leafBudget(child->depth);
-                float total = totalCountAcrossEntities(child->id, leafAlpha / 3);
-                float weight = total / numDataPoints;
-                assert(weight <= 1.0);
-                child->weight = weight;
-
-                DEBUG_PRINTF("Split %zu has %d/%d\n", i,
-                             (int)std::round(totalCountAcrossEntities(child->id, INT_MAX)),
-                             workedTotal);
-
-                if (weight <= eps / maxNumNodes) {
-                    DEBUG_PRINTF(
-                        "Node %d has weight %f=%f/%d too small, less than %f\n",
-                        child->id, weight, total, numDataPoints, eps / maxNumNodes);
-                    continue;
+            };
+            if (options.counterNoise) {
+                pool_->parallelFor(children.size(), splitChild);
+            }
+            else {
+                for (size_t i = 0; i < children.size(); i++) {
+                    splitChild(i);
                 }
-                std::tie(splitFnHat, Jhat) =
-                    privateSplit(child, total, 2 * leafAlpha / 3);
-                if (std::isnan(Jhat)) {
-                    DEBUG_PRINTF("Node %d has NaN Jhat\n", child->id);
+            }
+            for (size_t i = 0; i < children.size(); i++) {
+                if (std::isnan(totals[i])) {
                     continue;
                 }
-                // TODO: hardcoded threshold value right now
-                if (Jhat < 1e-2) {
-                    DEBUG_PRINTF(
-                        "Node %d has Jhat %f (id=%d), which is too small\n",
-                        child->id, Jhat, splitFnHat->id);
-                    continue;
+                std::tie(splitFnHat, Jhat) = splits[i];
+                if (splitWorthwhile(children[i], splitFnHat, Jhat)) {
+                    Q.push(QueueDataType(children[i]->weight * Jhat, children[i], splitFnHat));
                 }
-                Q.push(QueueDataType(weight * Jhat, child, splitFnHat));
             }
         }
 
-        // labelling the leaves with the rest of the budget
-        float leavesLabelingAlpha = alpha * leafPrivacyFraction;
-        int maxAchievedDepth = 1;
-        std::queue<std::shared_ptr<CoordinatorNode>> BFS;
-        BFS.push(root);
-        while (!BFS.empty()) {
-            std::shared_ptr<CoordinatorNode> node = BFS.front();
-            maxAchievedDepth = std::max(maxAchievedDepth, node->depth);
-            BFS.pop();
+        int maxAchievedDepth = labelLeaves(root, alpha * leafPrivacyFraction);
+        return std::make_tuple(root, id2node_.size(), maxAchievedDepth);
+    }
 
-            if (node->children.empty()) {
-                assert(node->isLeaf);
-                std::unordered_map<int, float> counts =
-                    labelCountsAcrossEntities(node->id, leavesLabelingAlpha);
-                float maxCount = 0;
-                int bestLabel = -1;
-                for (auto& label2count : counts) {
-                    if (label2count.second > maxCount) {
-                        maxCount = label2count.second;
-                        bestLabel = label2count.first;
-                    }
+    /*
+     * Grows the tree one depth at a time instead of best leaf first. The
+     * leaves of a depth are counted together, which each entity does in one
+     * pass over their rows (see Entity::countLeaves), and then expanded in
+     * order of priority while nodes remain. Every node gets the same budget
+     * as in train, but the tree and the order of queries differ.
+     */
+    std::tuple<std::shared_ptr<CoordinatorNode>, int, int> trainLevelWise(float alpha)
+    {
+        float splitsAlpha = alpha * (1. - leafPrivacyFraction);
+
+        std::shared_ptr<CoordinatorNode> root =
+            std::make_shared<CoordinatorNode>(/*id=*/0, /*depth=*/1);
+        root->weight = 1.0;
+        id2node_.push_back(root);
+
+        // leaves of the current depth with their noised totals
+        std::vector<std::tuple<std::shared_ptr<CoordinatorNode>, float>> level = {
+            std::make_tuple(root, (float)numDataPoints)};
+        while (!level.empty() && (int)id2node_.size() < maxNumNodes) {
+            std::vector<int> ids;
+            for (const auto& leaf2total : level) {
+                ids.push_back(std::get<0>(leaf2total)->id);
+            }
+            pool_->parallelFor(entities.size(), [&](size_t i) { entities[i]->countLeaves(ids); });
+
+            std::vector<QueueDataType> expansions;
+            for (const auto& leaf2total : level) {
+                const std::shared_ptr<CoordinatorNode>& leaf = std::get<0>(leaf2total);
+                // the root's total is public, other leaves spent a third of
+                // their budget on theirs
+                float leafAlpha = splitsAlpha * leafBudget(leaf->depth);
+                float splitAlpha = leaf == root ? leafAlpha : 2 * leafAlpha / 3;
+                std::shared_ptr<Split> splitFnHat;
+                float Jhat;
+                std::tie(splitFnHat, Jhat) = privateSplit(leaf, std::get<1>(leaf2total), splitAlpha);
+                if (leaf == root) {
+                    assert(splitFnHat != nullptr);
                 }
-                node->label = bestLabel;
+                else if (!splitWorthwhile(leaf, splitFnHat, Jhat)) {
+                    continue;
+                }
+                expansions.emplace_back(leaf->weight * Jhat, leaf, splitFnHat);
             }
-
-            for (auto& split2child : node->children) {
-                BFS.push(split2child.second);
+            std::stable_sort(expansions.begin(), expansions.end(),
+                             [](const QueueDataType& a, const QueueDataType& b) {
+                                 return a.priority > b.priority;
+                             });
+
+            // each expansion adds a child per branch; all of them are split
+            // at once, which entities that stream their rows do in one pass
+            size_t numExpanded = 0;
+            for (size_t numNodes = id2node_.size();
+                 numExpanded < expansions.size() && (int)numNodes < maxNumNodes; numExpanded++) {
+                numNodes += expansions[numExpanded].splitFn->labels.size();
+            }
+            expansions.erase(expansions.begin() + numExpanded, expansions.end());
+            expandLeaves(expansions);
+
+            level.clear();
+            for (const QueueDataType& expansion : expansions) {
+                for (size_t i = 0; i < expansion.splitFn->labels.size(); i++) {
+                    std::shared_ptr<CoordinatorNode> child = addChild(expansion.leaf, i);
+                    float total = childTotal(child, splitsAlpha);
+                    if (!std::isnan(total)) {
+                        level.push_back(std::make_tuple(child, total));
+                    }
+                }
             }
         }
+
+        int maxAchievedDepth = labelLeaves(root, alpha * leafPrivacyFraction);
         return std::make_tuple(root, id2node_.size(), maxAchievedDepth);
     }
 
+    /*
+     * The threads the coordinator queries entities on, free once training
+     * is done.
+     */
+    const std::shared_ptr<ThreadPool>& threadPool() const
+    {
+        return pool_;
+    }
+
     const float leafPrivacyFraction;
     const int maxNumNodes;
     const int maxDepth;
@@ -238,86 +319,217 @@ public:
     const std::string budgetFn;
     const std::string algo;
     const int numDataPoints;
-    std::vector<Entity> entities;
+    std::vector<std::shared_ptr<EntityInterface>> entities;
     const std::vector<std::shared_ptr<Split>> splittingClass;
     const std::shared_ptr<SplittingCriterion> splittingCriterion;
+    const CoordinatorOptions options;
 
 private:
-    std::unordered_map<int, float> splitCountsAcrossEntities(
-        int id, const std::shared_ptr<Split>& splitFn, float privacyEps) const
+    /*
+     * Sums of the entities' noised counts, which are dense arrays of the
+     * same length at every entity.
+     */
+    static void addCounts(const std::vector<float>& counts, std::vector<float>& total)
     {
-        std::unordered_map<int, float> splitCounts, tmpSplitCounts;
-        for (size_t i = 0; i < entities.size(); i++) {
-            tmpSplitCounts = entities[i].getSplitCounts(id, splitFn, privacyEps);
-
-            // aggregating splitCounts
-            for (auto& split2count : tmpSplitCounts) {
-                if (splitCounts.find(split2count.first) == splitCounts.end()) {
-                    splitCounts.insert(split2count);
-                    continue;
-                }
-                splitCounts[split2count.first] += split2count.second;
-            }
+        if (total.empty()) {
+            total.assign(counts.size(), 0.0);
+        }
+        assert(counts.size() == total.size());
+        for (size_t i = 0; i < counts.size(); i++) {
+            total[i] += counts[i];
         }
-        return splitCounts;
     }
 
-    std::unordered_map<int, std::unordered_map<int, float>> splitLabelCountsAcrossEntities(
-        int id, const std::shared_ptr<Split>& splitFn, float privacyEps) const
+    /*
+     * query(entity) for every entity, run on the pool. Each entity only
+     * touches its own state, and its results come back in entity order so
+     * that the reductions below do not depend on scheduling.
+     */
+    template <typename Query>
+    auto queryEntities(const Query& query) const
+        -> std::vector<decltype(query(std::declval<const EntityInterface&>()))>
     {
-        std::unordered_map<int, std::unordered_map<int, float>> splitLabelCount,
-            tmpSplitLabelCount;
-        for (size_t i = 0; i < entities.size(); i++) {
-            tmpSplitLabelCount = entities[i].getSplitLabelCounts(id, splitFn, privacyEps);
-
-            // aggregating splitLabelCount
-            for (auto& split2labelCount : tmpSplitLabelCount) {
-                if (splitLabelCount.find(split2labelCount.first) ==
-                    splitLabelCount.end()) {
-                    splitLabelCount.insert({split2labelCount});
-                    continue;
-                }
-                for (auto& label2count : split2labelCount.second) {
-                    if (splitLabelCount[split2labelCount.first].find(label2count.first) ==
-                        splitLabelCount[split2labelCount.first].end()) {
-                        splitLabelCount[split2labelCount.first].insert({label2count});
-                        continue;
-                    }
-                    splitLabelCount[split2labelCount.first][label2count.first] +=
-                        label2count.second;
-                }
-            }
-        }
-        return splitLabelCount;
+        std::vector<decltype(query(std::declval<const EntityInterface&>()))> results(
+            entities.size());
+        pool_->parallelFor(entities.size(), [&](size_t i) { results[i] = query(*entities[i]); });
+        return results;
     }
 
-    std::unordered_map<int, float> labelCountsAcrossEntities(int id, float privacyEps) const
+    std::vector<float> labelCountsAcrossEntities(int id, float privacyEps) const
     {
-        std::unordered_map<int, float> labelCount, tmpLabelCount;
-        for (size_t i = 0; i < entities.size(); i++) {
-            tmpLabelCount = entities[i].getLabelCounts(id, privacyEps);
-
-            // aggregating labelCount
-            for (auto& label2count : tmpLabelCount) {
-                if (labelCount.find(label2count.first) == labelCount.end()) {
-                    labelCount.insert(label2count);
-                    continue;
-                }
-                labelCount[label2count.first] += label2count.second;
-            }
+        std::vector<float> labelCounts;
+        for (const std::vector<float>& counts : queryEntities([&](const EntityInterface& entity) {
+                 return entity.getLabelCounts(id, privacyEps);
+             })) {
+            addCounts(counts, labelCounts);
         }
-        return labelCount;
+        return labelCounts;
     }
 
     float totalCountAcrossEntities(int id, float privacyEps) const
     {
         float totalCount = 0;
-        for (size_t i = 0; i < entities.size(); i++) {
-            totalCount += entities[i].getTotalCount(id, privacyEps);
+        for (float count : queryEntities([&](const EntityInterface& entity) {
+                 return entity.getTotalCount(id, privacyEps);
+             })) {
+            totalCount += count;
         }
         return totalCount;
     }
 
+    /*
+     * Turns leaf into an internal node split by splitFn, at every entity.
+     */
+    void expandLeaf(const std::shared_ptr<CoordinatorNode>& leaf,
+                    const std::shared_ptr<Split>& splitFn)
+    {
+        expandLeaves({QueueDataType(0, leaf, splitFn)});
+    }
+
+    /*
+     * expandLeaf for every expansion, with one request per entity.
+     */
+    void expandLeaves(const std::vector<QueueDataType>& expansions)
+    {
+        std::vector<int> ids;
+        std::vector<std::shared_ptr<Split>> splitFns;
+        for (const QueueDataType& expansion : expansions) {
+            const std::shared_ptr<CoordinatorNode>& leaf = expansion.leaf;
+            const std::shared_ptr<Split>& splitFn = expansion.splitFn;
+            leaf->splitFn = splitFn;
+            leaf->splitKernel = makeSplitKernel(splitFn);
+            assert(leaf->isLeaf);
+            leaf->isLeaf = false;
+#if defined(DEBUG) && DEBUG > 1
+            int workedTotal = std::round(totalCountAcrossEntities(leaf->id, INT_MAX));
+#endif
+            DEBUG_PRINTF(
+                "Node: %d\tweight: %f\tdepth: %d\twith "
+                "%d/%d\tSplitFn %d (%s)\n",
+                leaf->id, leaf->weight, leaf->depth, workedTotal, numDataPoints,
+                splitFn->id, splitFn->toString().c_str());
+            ids.push_back(leaf->id);
+            splitFns.push_back(splitFn);
+        }
+
+        // tell entities to split the leaves with their split functions
+        pool_->parallelFor(entities.size(), [&](size_t i) {
+            entities[i]->splitLeaves(ids, splitFns);
+        });
+    }
+
+    /*
+     * Adds the child for branch i of the split of leaf and returns it.
+     */
+    std::shared_ptr<CoordinatorNode> addChild(const std::shared_ptr<CoordinatorNode>& leaf,
+                                              size_t i)
+    {
+        std::shared_ptr<CoordinatorNode> child =
+            std::make_shared<CoordinatorNode>((int)id2node_.size(), leaf->depth + 1);
+        leaf->children.insert({leaf->splitFn->labels[i], child});
+        id2node_.push_back(child);
+        return child;
+    }
+
+    /*
+     * Noised total of a child added by addChild, which costs a third of the
+     * child's split budget, and sets its weight. The total is NaN if the
+     * child is too deep or too light to be split. Only touches child, so
+     * the children of a leaf may be counted concurrently.
+     */
+    float childTotal(const std::shared_ptr<CoordinatorNode>& child, float splitsAlpha) const
+    {
+        float nan = std::numeric_limits<float>::quiet_NaN();
+        if (child->depth >= maxDepth) {
+            return nan; // depth of internal node goes up to maxDepth-1
+        }
+
+        float leafAlpha = splitsAlpha * leafBudget(child->depth);
+        float total = totalCountAcrossEntities(child->id, leafAlpha / 3);
+        float weight = total / numDataPoints;
+        assert(weight <= 1.0);
+        child->weight = weight;
+
+        DEBUG_PRINTF("Child %d has %d\n", child->id,
+                     (int)std::round(totalCountAcrossEntities(child->id, INT_MAX)));
+
+        if (weight <= eps / maxNumNodes) {
+            DEBUG_PRINTF(
+                "Node %d has weight %f=%f/%d too small, less than %f\n",
+                child->id, weight, total, numDataPoints, eps / maxNumNodes);
+            return nan;
+        }
+        return total;
+    }
+
+    // leaf and splitFn only go into debug output
+    bool splitWorthwhile([[maybe_unused]] const std::shared_ptr<CoordinatorNode>& leaf,
+                         [[maybe_unused]] const std::shared_ptr<Split>& splitFn,
+                         float Jhat) const
+    {
+        if (std::isnan(Jhat)) {
+            DEBUG_PRINTF("Node %d has NaN Jhat\n", leaf->id);
+            return false;
+        }
+        // TODO: hardcoded threshold value right now
+        if (Jhat < 1e-2) {
+            DEBUG_PRINTF(
+                "Node %d has Jhat %f (id=%d), which is too small\n",
+                leaf->id, Jhat, splitFn->id);
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * Labels the leaves with the rest of the budget, and returns the depth
+     * of the tree.
+     */
+    int labelLeaves(const std::shared_ptr<CoordinatorNode>& root, float leavesLabelingAlpha) const
+    {
+        int maxAchievedDepth = 1;
+        std::vector<std::shared_ptr<CoordinatorNode>> leaves;
+        std::queue<std::shared_ptr<CoordinatorNode>> BFS;
+        BFS.push(root);
+        while (!BFS.empty()) {
+            std::shared_ptr<CoordinatorNode> node = BFS.front();
+            maxAchievedDepth = std::max(maxAchievedDepth, node->depth);
+            BFS.pop();
+
+            if (node->children.empty()) {
+                assert(node->isLeaf);
+                leaves.push_back(node);
+            }
+
+            for (auto& split2child : node->children) {
+                BFS.push(split2child.second);
+            }
+        }
+
+        // level-wise, the leaves are counted together as the levels were, so
+        // their label counts come from the entities' tensor caches
+        if (options.levelWise) {
+            std::vector<int> ids;
+            for (const std::shared_ptr<CoordinatorNode>& leaf : leaves) {
+                ids.push_back(leaf->id);
+            }
+            pool_->parallelFor(entities.size(), [&](size_t i) { entities[i]->countLeaves(ids); });
+        }
+        for (const std::shared_ptr<CoordinatorNode>& node : leaves) {
+            std::vector<float> counts = labelCountsAcrossEntities(node->id, leavesLabelingAlpha);
+            float maxCount = 0;
+            int bestLabel = -1;
+            for (size_t label = 0; label < counts.size(); label++) {
+                if (counts[label] > maxCount) {
+                    maxCount = counts[label];
+                    bestLabel = (int)label;
+                }
+            }
+            node->label = bestLabel;
+        }
+        return maxAchievedDepth;
+    }
+
     /*
      * Calls PrivateSplit and returns an estimate of (best split, J value of best split.
      */
@@ -328,13 +540,14 @@ private:
         float minCondG = INT_MAX;
         if (algo == "singleMachine") {
             assert((int)entities.size() == 1);
-            return entities[0].localRNM(leaf->id, privacyEps);
+            return entities[0]->localRNM(leaf->id, privacyEps);
         }
 
         std::vector<std::shared_ptr<Split>> candidateSplits;
         if (algo == "localRNM") {
-            for (size_t i = 0; i < entities.size(); i++) {
-                auto res = entities[i].localRNM(leaf->id, privacyEps / 2);
+            for (auto& res : queryEntities([&](const EntityInterface& entity) {
+                     return entity.localRNM(leaf->id, privacyEps / 2);
+                 })) {
                 if (std::get<0>(res) == nullptr) {
                     assert(std::isnan(std::get<1>(res)));
                     continue;
@@ -354,15 +567,53 @@ private:
 
         // 2/3 of the privacy budget in for loop, and 1/3 of privacy budget for labelCounts
         float eachEps = privacyEps / (3 * candidateSplits.size());
+        // split totals summed from the noised label counts cost no budget, so
+        // the label counts get the budget of the totals as well
+        float splitLabelEps = options.splitCountsFromLabelCounts ? 2 * eachEps : eachEps;
+        std::vector<NodeStatistics> statistics = queryEntities([&](const EntityInterface& entity) {
+            return entity.getNodeStatistics(leaf->id, candidateSplits, splitLabelEps, eachEps,
+                                            privacyEps / 3, !options.splitCountsFromLabelCounts);
+        });
+
+        // one row of label counts per (candidate, branch), rows of candidate i
+        // are [firstRow[i], firstRow[i + 1])
+        int numLabels = splittingCriterion->numLabels;
+        std::vector<float> branchLabelCounts;
+        std::vector<float> branchCounts;
+        std::vector<size_t> firstRow = {0};
+        for (size_t i = 0; i < candidateSplits.size(); i++) {
+            std::vector<float> splitLabelCounts;
+            std::vector<float> splitCounts;
+            for (const NodeStatistics& entityStatistics : statistics) {
+                addCounts(entityStatistics.splitLabelCounts[i], splitLabelCounts);
+                if (!options.splitCountsFromLabelCounts) {
+                    addCounts(entityStatistics.splitCounts[i], splitCounts);
+                }
+            }
+            if (options.splitCountsFromLabelCounts) {
+                splitCounts.assign(splitLabelCounts.size() / numLabels, 0.0);
+                for (size_t cell = 0; cell < splitLabelCounts.size(); cell++) {
+                    splitCounts[cell / numLabels] += splitLabelCounts[cell];
+                }
+            }
+            assert(splitLabelCounts.size() == splitCounts.size() * numLabels);
+            branchLabelCounts.insert(branchLabelCounts.end(), splitLabelCounts.begin(),
+                                     splitLabelCounts.end());
+            branchCounts.insert(branchCounts.end(), splitCounts.begin(), splitCounts.end());
+            firstRow.push_back(branchCounts.size());
+        }
+        std::vector<float> branchG(branchCounts.size());
+        splittingCriterion->calcGBatch(branchLabelCounts.data(), branchG.size(), branchG.data());
+
         for (size_t i = 0; i < candidateSplits.size(); i++) {
-            std::unordered_map<int, std::unordered_map<int, float>> splitLabelCounts =
-                splitLabelCountsAcrossEntities(leaf->id, candidateSplits[i], eachEps);
-            std::unordered_map<int, float> splitCounts =
-                splitCountsAcrossEntities(leaf->id, candidateSplits[i], eachEps);
             float condG = 0.0;
-            for (auto& split2labelCount : splitLabelCounts) {
-                condG += splitCounts.at(split2labelCount.first) / total *
-                         splittingCriterion->calcG(split2labelCount.second);
+            for (size_t row = firstRow[i]; row < firstRow[i + 1]; row++) {
+                // branches without any noised label count did not occur at any entity
+                const float* labelCounts = branchLabelCounts.data() + row * numLabels;
+                if (std::any_of(labelCounts, labelCounts + numLabels,
+                                [](float count) { return count > 0; })) {
+                    condG += branchCounts[row] / total * branchG[row];
+                }
             }
 
             if (std::isnan(condG)) {
@@ -375,13 +626,17 @@ private:
                 bestSplit = candidateSplits[i];
             }
         }
-        std::unordered_map<int, float> labelCounts =
-            labelCountsAcrossEntities(leaf->id, privacyEps / 3);
-        float infoGain = splittingCriterion->calcG(labelCounts) - minCondG;
+        std::vector<float> labelCounts;
+        for (const NodeStatistics& entityStatistics : statistics) {
+            addCounts(entityStatistics.labelCounts, labelCounts);
+        }
+        float infoGain = splittingCriterion->calcG(labelCounts.data()) - minCondG;
         return std::make_tuple(bestSplit, infoGain);
     }
 
     std::vector<std::shared_ptr<CoordinatorNode>> id2node_;
+    // fans entity queries out, see queryEntities
+    std::shared_ptr<ThreadPool> pool_;
 };
 
 #endif // D3T_COORDINATOR_H
@@ -0,0 +1,118 @@
+/** @file counts.h
+ *  @brief Dense count tensors indexed by [split][branch][label]. Entities fill
+ *         one of these in a single pass over a node's rows, and split counts
+ *         and label counts are derived from it.
+ */
+
+#ifndef D3T_COUNTS_H
+#define D3T_COUNTS_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+class CountTensor {
+public:
+    CountTensor(int numSplits, int numBranches, int numLabels)
+        : numSplits(numSplits),
+          numBranches(numBranches),
+          numLabels(numLabels),
+          counts((size_t)numSplits * numBranches * numLabels, 0)
+    {
+    }
+
+    int& at(int split, int branch, int label)
+    {
+        return counts[offset(split, branch, label)];
+    }
+
+    int at(int split, int branch, int label) const
+    {
+        return counts[offset(split, branch, label)];
+    }
+
+    /*
+     * Adds other cell by cell, e.g. the counts of another chunk of rows.
+     */
+    void add(const CountTensor& other)
+    {
+        assert(other.counts.size() == counts.size());
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+    }
+
+    /*
+     * Subtracts other cell by cell, e.g. a child's counts from its parent's.
+     */
+    void subtract(const CountTensor& other)
+    {
+        assert(other.counts.size() == counts.size());
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] -= other.counts[i];
+        }
+    }
+
+    size_t bytes() const
+    {
+        return counts.size() * sizeof(int);
+    }
+
+    /*
+     * The counts of the given splits, in that order, as a new tensor.
+     */
+    CountTensor select(const std::vector<int>& splits) const
+    {
+        CountTensor result((int)splits.size(), numBranches, numLabels);
+        size_t splitSize = (size_t)numBranches * numLabels;
+        for (size_t i = 0; i < splits.size(); i++) {
+            assert(splits[i] >= 0 && splits[i] < numSplits);
+            std::copy(counts.begin() + splits[i] * splitSize,
+                      counts.begin() + (splits[i] + 1) * splitSize,
+                      result.counts.begin() + i * splitSize);
+        }
+        return result;
+    }
+
+    int splitCount(int split, int branch) const
+    {
+        int result = 0;
+        for (int label = 0; label < numLabels; label++) {
+            result += at(split, branch, label);
+        }
+        return result;
+    }
+
+    /*
+     * Counts per label of the whole node. Every split sends each row down
+     * exactly one branch, so any split's branches sum to the node's counts.
+     */
+    std::vector<int> labelCounts() const
+    {
+        assert(numSplits > 0);
+        std::vector<int> result(numLabels, 0);
+        for (int branch = 0; branch < numBranches; branch++) {
+            for (int label = 0; label < numLabels; label++) {
+                result[label] += at(0, branch, label);
+            }
+        }
+        return result;
+    }
+
+    int numSplits;
+    int numBranches;
+    int numLabels;
+    std::vector<int> counts;
+
+private:
+    size_t offset(int split, int branch, int label) const
+    {
+        assert(split >= 0 && split < numSplits);
+        assert(branch >= 0 && branch < numBranches);
+        assert(label >= 0 && label < numLabels);
+        return ((size_t)split * numBranches + branch) * numLabels + label;
+    }
+};
+
+#endif // D3T_COUNTS_H
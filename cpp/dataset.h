@@ -0,0 +1,220 @@
+/** @file dataset.h
+ *  @brief Feature matrix and labels in contiguous, aligned buffers. The
+ *         features are kept both row-major, for splits that need a whole
+ *         datum, and column-major (feature-major), so that scans over one
+ *         attribute stream through a single column.
+ */
+
+#ifndef D3T_DATASET_H
+#define D3T_DATASET_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+// alignment of every buffer and of the start of every column, in bytes
+constexpr size_t DATASET_ALIGNMENT = 64;
+
+template <typename T>
+std::shared_ptr<T> allocateAligned(size_t count)
+{
+    size_t bytes = count * sizeof(T);
+    // aligned_alloc requires a multiple of the alignment
+    bytes = (bytes + DATASET_ALIGNMENT - 1) / DATASET_ALIGNMENT * DATASET_ALIGNMENT;
+    void* ptr = std::aligned_alloc(DATASET_ALIGNMENT, bytes > 0 ? bytes : DATASET_ALIGNMENT);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memset(ptr, 0, bytes);
+    return std::shared_ptr<T>(static_cast<T*>(ptr), [](T* p) { std::free(p); });
+}
+
+/*
+ * Copies of a Dataset share its buffers, so a Dataset should be filled in
+ * with setRow before it is handed out and treated as immutable afterwards.
+ */
+class Dataset {
+public:
+    Dataset() : numRows(0), numCols(0), colStride(0)
+    {
+    }
+
+    Dataset(size_t numRows, size_t numCols)
+        : numRows(numRows),
+          numCols(numCols),
+          colStride(roundUpToAlignment(numRows)),
+          rowMajor_(allocateAligned<float>(numRows * numCols)),
+          colMajor_(allocateAligned<float>(colStride * numCols)),
+          labels_(allocateAligned<int>(numRows))
+    {
+    }
+
+    /*
+     * A Dataset over the row-major features rowMajor and the labels, whose
+     * column-major layout is built from them here. A loader can fill
+     * rowMajor first and free its own copy of the features before the second
+     * layout is allocated.
+     */
+    Dataset(size_t numRows,
+            size_t numCols,
+            std::shared_ptr<float> rowMajor,
+            std::shared_ptr<int> labels)
+        : numRows(numRows),
+          numCols(numCols),
+          colStride(roundUpToAlignment(numRows)),
+          rowMajor_(std::move(rowMajor)),
+          colMajor_(allocateAligned<float>(colStride * numCols)),
+          labels_(std::move(labels))
+    {
+        for (size_t r = 0; r < numRows; r++) {
+            const float* values = row(r);
+            for (size_t c = 0; c < numCols; c++) {
+                colMajor_.get()[c * colStride + r] = values[c];
+            }
+        }
+    }
+
+    /*
+     * A Dataset over buffers owned elsewhere, e.g. a mapped file, which the
+     * shared_ptrs keep alive.
+     */
+    Dataset(size_t numRows,
+            size_t numCols,
+            size_t colStride,
+            std::shared_ptr<float> rowMajor,
+            std::shared_ptr<float> colMajor,
+            std::shared_ptr<int> labels)
+        : numRows(numRows),
+          numCols(numCols),
+          colStride(colStride),
+          rowMajor_(std::move(rowMajor)),
+          colMajor_(std::move(colMajor)),
+          labels_(std::move(labels))
+    {
+        assert(colStride >= numRows);
+    }
+
+    Dataset(const std::vector<std::vector<float>>& rows, const std::vector<int>& labels)
+        : Dataset(rows.size(), rows.empty() ? 0 : rows[0].size())
+    {
+        assert(rows.size() == labels.size());
+        for (size_t r = 0; r < numRows; r++) {
+            assert(rows[r].size() == numCols);
+            setRow(r, rows[r].data(), labels[r]);
+        }
+    }
+
+    void setRow(size_t r, const float* values, int label)
+    {
+        assert(r < numRows);
+        std::memcpy(rowMajor_.get() + r * numCols, values, numCols * sizeof(float));
+        for (size_t c = 0; c < numCols; c++) {
+            colMajor_.get()[c * colStride + r] = values[c];
+        }
+        labels_.get()[r] = label;
+    }
+
+    const float* row(size_t r) const
+    {
+        return rowMajor_.get() + r * numCols;
+    }
+
+    const float* column(size_t c) const
+    {
+        return colMajor_.get() + c * colStride;
+    }
+
+    float at(size_t r, size_t c) const
+    {
+        return column(c)[r];
+    }
+
+    std::vector<float> rowVector(size_t r) const
+    {
+        return std::vector<float>(row(r), row(r) + numCols);
+    }
+
+    int label(size_t r) const
+    {
+        return labels_.get()[r];
+    }
+
+    const int* labels() const
+    {
+        return labels_.get();
+    }
+
+    size_t numRows;
+    size_t numCols;
+    // distance in floats between the starts of consecutive columns
+    size_t colStride;
+
+private:
+    static size_t roundUpToAlignment(size_t numFloats)
+    {
+        size_t perLine = DATASET_ALIGNMENT / sizeof(float);
+        return (numFloats + perLine - 1) / perLine * perLine;
+    }
+
+    std::shared_ptr<float> rowMajor_;
+    std::shared_ptr<float> colMajor_;
+    std::shared_ptr<int> labels_;
+};
+
+// most columns of a one-hot block, so that a category and "none" fit a byte
+constexpr size_t ONE_HOT_MAX_COLUMNS = 255;
+
+/*
+ * Blocks of at least two consecutive columns among columns (increasing)
+ * that look like a one-hot encoding in data: every value is 0 or 1 and no
+ * row has a 1 in two columns of a block. Columns are added to the current
+ * block greedily, so two encodings side by side become two blocks as soon
+ * as some row is hot in both.
+ */
+inline std::vector<std::vector<int>> findOneHotBlocks(const Dataset& data,
+                                                      const std::vector<int>& columns)
+{
+    std::vector<std::vector<int>> blocks;
+    // rows with a 1 in the last block so far
+    std::vector<uint8_t> hot(data.numRows, 0);
+    bool open = false;
+    for (int c : columns) {
+        const float* column = data.column(c);
+        bool binary = true;
+        bool disjoint = true;
+        for (size_t r = 0; r < data.numRows && binary; r++) {
+            binary = column[r] == 0.0f || column[r] == 1.0f;
+            disjoint = disjoint && !(column[r] == 1.0f && hot[r]);
+        }
+        if (open && (!binary || !disjoint || blocks.back().back() != c - 1 ||
+                     blocks.back().size() == ONE_HOT_MAX_COLUMNS)) {
+            if (blocks.back().size() < 2) {
+                blocks.pop_back();
+            }
+            open = false;
+        }
+        if (!binary) {
+            continue;
+        }
+        if (!open) {
+            blocks.emplace_back();
+            std::fill(hot.begin(), hot.end(), 0);
+            open = true;
+        }
+        blocks.back().push_back(c);
+        for (size_t r = 0; r < data.numRows; r++) {
+            hot[r] |= column[r] == 1.0f;
+        }
+    }
+    if (open && blocks.back().size() < 2) {
+        blocks.pop_back();
+    }
+    return blocks;
+}
+
+#endif // D3T_DATASET_H
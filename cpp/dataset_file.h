@@ -0,0 +1,511 @@
+/** @file dataset_file.h
+ *  @brief Versioned binary dataset files, which are mapped into memory
+ *         instead of parsed. A file holds a header, the labels, and the
+ *         feature matrix row-major and/or column-major in the layout of
+ *         Dataset, each section starting on a page. Runs mapping the same
+ *         file share it through the page cache. Values are in the byte order
+ *         of the host that wrote the file.
+ */
+
+#ifndef D3T_DATASET_FILE_H
+#define D3T_DATASET_FILE_H
+
+#include "dataset.h"
+#include "utils.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+constexpr char DATASET_FILE_MAGIC[8] = {'D', '3', 'T', 'D', 'A', 'T', 'A', '\0'};
+// bumped whenever the layout of the file changes
+constexpr uint32_t DATASET_FILE_VERSION = 1;
+constexpr uint32_t DATASET_FILE_ROW_MAJOR = 1;
+constexpr uint32_t DATASET_FILE_COL_MAJOR = 2;
+constexpr size_t DATASET_FILE_ALIGNMENT = 4096;
+// labels read at a time when checking a streamed file
+constexpr size_t DATASET_FILE_LABEL_CHUNK = (size_t)1 << 20;
+// suffix of converted files, next to the protobuf files in ../data
+const std::string DATASET_FILE_SUFFIX = ".d3t";
+
+struct DatasetFileHeader {
+    char magic[8];
+    uint32_t version;
+    // DATASET_FILE_ROW_MAJOR | DATASET_FILE_COL_MAJOR
+    uint32_t layouts;
+    uint64_t numRows;
+    uint64_t numCols;
+    uint64_t numLabels;
+    // floats between the starts of consecutive columns, see Dataset
+    uint64_t colStride;
+    // of the sections, in bytes from the start of the file; 0 if absent
+    uint64_t labelsOffset;
+    uint64_t rowMajorOffset;
+    uint64_t colMajorOffset;
+};
+
+/*
+ * Writes data with the given layouts to path, returns true if successful.
+ */
+bool writeDatasetFile(const Dataset& data, int numLabels, uint32_t layouts, const std::string& path)
+{
+    assert(layouts != 0 && (layouts & ~(DATASET_FILE_ROW_MAJOR | DATASET_FILE_COL_MAJOR)) == 0);
+    auto align = [](uint64_t offset) {
+        return (offset + DATASET_FILE_ALIGNMENT - 1) / DATASET_FILE_ALIGNMENT *
+               DATASET_FILE_ALIGNMENT;
+    };
+    DatasetFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, DATASET_FILE_MAGIC, sizeof(header.magic));
+    header.version = DATASET_FILE_VERSION;
+    header.layouts = layouts;
+    header.numRows = data.numRows;
+    header.numCols = data.numCols;
+    header.numLabels = numLabels;
+    header.colStride = data.colStride;
+    uint64_t end = align(sizeof(header));
+    header.labelsOffset = end;
+    end = align(end + data.numRows * sizeof(int));
+    if (layouts & DATASET_FILE_ROW_MAJOR) {
+        header.rowMajorOffset = end;
+        end = align(end + data.numRows * data.numCols * sizeof(float));
+    }
+    if (layouts & DATASET_FILE_COL_MAJOR) {
+        header.colMajorOffset = end;
+        end += data.colStride * data.numCols * sizeof(float);
+    }
+
+    std::ofstream output(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    auto writeAt = [&](uint64_t offset, const void* bytes, size_t size) {
+        output.seekp(offset);
+        output.write(static_cast<const char*>(bytes), size);
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.labelsOffset, data.labels(), data.numRows * sizeof(int));
+    if (header.rowMajorOffset != 0) {
+        writeAt(header.rowMajorOffset, data.row(0), data.numRows * data.numCols * sizeof(float));
+    }
+    if (header.colMajorOffset != 0) {
+        // padding of the columns included, so the file ends at end
+        std::vector<float> column(data.colStride, 0);
+        for (size_t c = 0; c < data.numCols; c++) {
+            std::copy(data.column(c), data.column(c) + data.numRows, column.begin());
+            writeAt(header.colMajorOffset + c * data.colStride * sizeof(float), column.data(),
+                    column.size() * sizeof(float));
+        }
+    }
+    if (!output) {
+        std::cerr << "failed to write dataset to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Whether header, read from the file at path of fileSize bytes, is of this
+ * version and its sections lie within the file. The sizes of the sections
+ * are products of header fields, which are checked for overflow so that a
+ * corrupt header cannot pass with a wrapped size.
+ */
+bool checkDatasetFileHeader(const DatasetFileHeader& header,
+                            size_t fileSize,
+                            const std::string& path)
+{
+    if (std::memcmp(header.magic, DATASET_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != DATASET_FILE_VERSION) {
+        std::cerr << path << " is not a version " << DATASET_FILE_VERSION << " dataset file"
+                  << std::endl;
+        return false;
+    }
+    auto fits = [&](uint64_t offset, uint64_t bytes) {
+        return offset % sizeof(float) == 0 && offset <= fileSize && bytes <= fileSize - offset;
+    };
+    // false on overflow
+    auto sectionBytes = [](uint64_t count, uint64_t size, uint64_t elementBytes,
+                           uint64_t& bytes) {
+        return !__builtin_mul_overflow(count, size, &bytes) &&
+               !__builtin_mul_overflow(bytes, elementBytes, &bytes);
+    };
+    bool hasRowMajor = header.rowMajorOffset != 0;
+    bool hasColMajor = header.colMajorOffset != 0;
+    uint64_t labelsBytes, rowMajorBytes, colMajorBytes;
+    // rows, columns and labels are counted in ints
+    uint64_t maxCount = std::numeric_limits<int>::max();
+    if (header.numRows > maxCount || header.numCols > maxCount || header.numLabels == 0 ||
+        header.numLabels > maxCount ||
+        !sectionBytes(header.numRows, 1, sizeof(int), labelsBytes) ||
+        !fits(header.labelsOffset, labelsBytes) ||
+        (hasRowMajor &&
+         (!sectionBytes(header.numRows, header.numCols, sizeof(float), rowMajorBytes) ||
+          !fits(header.rowMajorOffset, rowMajorBytes))) ||
+        (hasColMajor &&
+         (header.colStride < header.numRows ||
+          !sectionBytes(header.colStride, header.numCols, sizeof(float), colMajorBytes) ||
+          !fits(header.colMajorOffset, colMajorBytes))) ||
+        (!hasRowMajor && !hasColMajor)) {
+        std::cerr << path << " is truncated or corrupt" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Whether labels[0..n) all lie in [0, numLabels), as they index the cells
+ * of count tensors.
+ */
+bool checkDatasetFileLabels(const int* labels,
+                            size_t n,
+                            uint64_t numLabels,
+                            const std::string& path)
+{
+    for (size_t r = 0; r < n; r++) {
+        if (labels[r] < 0 || (uint64_t)labels[r] >= numLabels) {
+            std::cerr << path << " has a label " << labels[r] << " outside [0, " << numLabels
+                      << ")" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Maps the dataset file at path into data and returns its number of labels,
+ * or 0 if it cannot be read, like parseProtobuf. data points into the
+ * read-only mapping, which lives as long as data and its copies. A file
+ * with one layout gets the other one built in memory, so it takes one copy
+ * of the features in memory; stream such files instead when they do not
+ * fit (see openStreamedDataset).
+ */
+size_t mapDatasetFile(Dataset& data, const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << path << " not found!" << std::endl;
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(DatasetFileHeader)) {
+        std::cerr << path << " is not a dataset file" << std::endl;
+        close(fd);
+        return 0;
+    }
+    size_t fileSize = st.st_size;
+    void* base = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "failed to map " << path << ": " << strerror(errno) << std::endl;
+        return 0;
+    }
+    std::shared_ptr<char> mapping(static_cast<char*>(base),
+                                  [fileSize](char* p) { munmap(p, fileSize); });
+
+    DatasetFileHeader header;
+    std::memcpy(&header, mapping.get(), sizeof(header));
+    if (!checkDatasetFileHeader(header, fileSize, path)) {
+        return 0;
+    }
+    bool hasRowMajor = header.rowMajorOffset != 0;
+    bool hasColMajor = header.colMajorOffset != 0;
+
+    std::shared_ptr<int> labels(mapping,
+                                reinterpret_cast<int*>(mapping.get() + header.labelsOffset));
+    if (!checkDatasetFileLabels(labels.get(), header.numRows, header.numLabels, path)) {
+        return 0;
+    }
+    std::shared_ptr<float> rowMajor, colMajor;
+    if (hasRowMajor) {
+        rowMajor = std::shared_ptr<float>(
+            mapping, reinterpret_cast<float*>(mapping.get() + header.rowMajorOffset));
+    }
+    if (hasColMajor) {
+        colMajor = std::shared_ptr<float>(
+            mapping, reinterpret_cast<float*>(mapping.get() + header.colMajorOffset));
+    }
+    // a missing layout is built in memory, and the mapped one is used as is
+    if (hasRowMajor && hasColMajor) {
+        data = Dataset(header.numRows, header.numCols, header.colStride, rowMajor, colMajor,
+                       labels);
+    }
+    else if (hasRowMajor) {
+        data = Dataset(header.numRows, header.numCols, rowMajor, labels);
+    }
+    else {
+        rowMajor = allocateAligned<float>(header.numRows * header.numCols);
+        for (size_t r = 0; r < header.numRows; r++) {
+            for (size_t c = 0; c < header.numCols; c++) {
+                rowMajor.get()[r * header.numCols + c] = colMajor.get()[c * header.colStride + r];
+            }
+        }
+        data = Dataset(header.numRows, header.numCols, header.colStride, rowMajor, colMajor,
+                       labels);
+    }
+    printf("Mapped %lu x %lu data_ with %lu distinct labels_ from %s\n", data.numRows,
+           data.numCols, header.numLabels, path.c_str());
+    return header.numLabels;
+}
+
+/*
+ * Reads rows of a dataset file on demand instead of mapping all of it, for
+ * entities that stream their rows through memory (see
+ * EntityOptions::streamChunkRows). The file needs its row-major section.
+ * Reads may come from any thread.
+ */
+class DatasetFileReader {
+public:
+    explicit DatasetFileReader(const std::string& path) : path(path), fd_(-1)
+    {
+        std::memset(&header, 0, sizeof(header));
+        fd_ = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || fstat(fd_, &st) < 0 || (size_t)st.st_size < sizeof(header) ||
+            !readFully(0, &header, sizeof(header)) ||
+            !checkDatasetFileHeader(header, st.st_size, path)) {
+            std::cerr << "cannot stream " << path << std::endl;
+            std::memset(&header, 0, sizeof(header));
+        }
+        else if (header.rowMajorOffset == 0) {
+            std::cerr << "cannot stream " << path << " without its row-major section"
+                      << std::endl;
+            std::memset(&header, 0, sizeof(header));
+        }
+        else if (!checkLabels()) {
+            std::cerr << "cannot stream " << path << std::endl;
+            std::memset(&header, 0, sizeof(header));
+        }
+    }
+
+    DatasetFileReader(const DatasetFileReader&) = delete;
+    DatasetFileReader& operator=(const DatasetFileReader&) = delete;
+
+    ~DatasetFileReader()
+    {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool ok() const
+    {
+        return header.version == DATASET_FILE_VERSION;
+    }
+
+    /*
+     * Rows [begin, end) of the file as a Dataset of their own.
+     */
+    Dataset readRows(size_t begin, size_t end) const
+    {
+        assert(ok() && begin <= end && end <= header.numRows);
+        size_t n = end - begin;
+        size_t numCols = header.numCols;
+        std::vector<float> rowMajor(n * numCols);
+        std::vector<int> labels(n);
+        bool read = readFully(header.rowMajorOffset + begin * numCols * sizeof(float),
+                              rowMajor.data(), rowMajor.size() * sizeof(float)) &&
+                    readFully(header.labelsOffset + begin * sizeof(int), labels.data(),
+                              labels.size() * sizeof(int));
+        if (!read) {
+            printf("FATAL: failed to read rows [%zu, %zu) of %s\n", begin, end, path.c_str());
+            assert(false);
+        }
+        Dataset result(n, numCols);
+        for (size_t r = 0; r < n; r++) {
+            result.setRow(r, rowMajor.data() + r * numCols, labels[r]);
+        }
+        return result;
+    }
+
+    const std::string path;
+    DatasetFileHeader header;
+
+private:
+    // reads the labels a chunk at a time, see checkDatasetFileLabels
+    bool checkLabels() const
+    {
+        std::vector<int> labels;
+        for (size_t begin = 0; begin < header.numRows; begin += DATASET_FILE_LABEL_CHUNK) {
+            labels.resize(std::min(header.numRows - begin, (uint64_t)DATASET_FILE_LABEL_CHUNK));
+            if (!readFully(header.labelsOffset + begin * sizeof(int), labels.data(),
+                           labels.size() * sizeof(int)) ||
+                !checkDatasetFileLabels(labels.data(), labels.size(), header.numLabels, path)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool readFully(uint64_t offset, void* data, size_t size) const
+    {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t got = pread(fd_, bytes, size, offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            bytes += got;
+            offset += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    int fd_;
+};
+
+/*
+ * Reads the row spans [begin, end) of a dataset file one after another for
+ * a single consumer, keeping up to readAhead spans read ahead of it on a
+ * thread of its own. With readAhead 0 every span is read when asked for.
+ */
+class RowSpanReader {
+public:
+    RowSpanReader(std::shared_ptr<const DatasetFileReader> file,
+                  std::vector<std::pair<size_t, size_t>> spans,
+                  size_t readAhead)
+        : file_(std::move(file)),
+          spans_(std::move(spans)),
+          readAhead_(readAhead),
+          nextRead_(0),
+          stop_(false)
+    {
+        if (readAhead_ > 0 && !spans_.empty()) {
+            reader_ = std::thread([this] { readLoop(); });
+        }
+    }
+
+    RowSpanReader(const RowSpanReader&) = delete;
+    RowSpanReader& operator=(const RowSpanReader&) = delete;
+
+    ~RowSpanReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        if (reader_.joinable()) {
+            reader_.join();
+        }
+    }
+
+    // the next span, in the order of spans
+    Dataset next()
+    {
+        if (readAhead_ == 0) {
+            assert(nextRead_ < spans_.size());
+            const std::pair<size_t, size_t>& span = spans_[nextRead_++];
+            return file_->readRows(span.first, span.second);
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return !ready_.empty(); });
+        Dataset result = std::move(ready_.front());
+        ready_.pop_front();
+        lock.unlock();
+        changed_.notify_all();
+        return result;
+    }
+
+private:
+    void readLoop()
+    {
+        for (const std::pair<size_t, size_t>& span : spans_) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this] { return stop_ || ready_.size() < readAhead_; });
+                if (stop_) {
+                    return;
+                }
+            }
+            Dataset data = file_->readRows(span.first, span.second);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_.push_back(std::move(data));
+            }
+            changed_.notify_all();
+        }
+    }
+
+    std::shared_ptr<const DatasetFileReader> file_;
+    const std::vector<std::pair<size_t, size_t>> spans_;
+    const size_t readAhead_;
+    // next span to read when not reading ahead
+    size_t nextRead_;
+    std::thread reader_;
+    // guards ready_ and stop_
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Dataset> ready_;
+    bool stop_;
+};
+
+/*
+ * Loads the dataset at path, from path + DATASET_FILE_SUFFIX if it has been
+ * converted and else from the protobuf file, and returns its number of
+ * labels (0 on failure). rows are the rows of data that seed and fraction
+ * pick, in the order parseProtobuf would have put them in.
+ */
+size_t openDataset(Dataset& data,
+                   std::vector<int>& rows,
+                   const std::string& path,
+                   int seed,
+                   float fraction)
+{
+    size_t numLabels;
+    rows.clear();
+    if (access((path + DATASET_FILE_SUFFIX).c_str(), R_OK) == 0) {
+        numLabels = mapDatasetFile(data, path + DATASET_FILE_SUFFIX);
+        for (size_t r : sampleRows(data.numRows, seed, fraction)) {
+            rows.push_back((int)r);
+        }
+    }
+    else {
+        numLabels = parseProtobuf(data, path, seed, fraction);
+        for (size_t r = 0; r < data.numRows; r++) {
+            rows.push_back((int)r);
+        }
+    }
+    return numLabels;
+}
+
+/*
+ * Opens the dataset file at path + DATASET_FILE_SUFFIX to stream its rows
+ * (see DatasetFileReader) without reading its features, and sets rows like
+ * openDataset does. Returns null if the file is missing or has no
+ * row-major section.
+ */
+std::shared_ptr<const DatasetFileReader> openStreamedDataset(std::vector<int>& rows,
+                                                             const std::string& path,
+                                                             int seed,
+                                                             float fraction)
+{
+    rows.clear();
+    std::shared_ptr<const DatasetFileReader> file =
+        std::make_shared<const DatasetFileReader>(path + DATASET_FILE_SUFFIX);
+    if (!file->ok()) {
+        return nullptr;
+    }
+    for (size_t r : sampleRows(file->header.numRows, seed, fraction)) {
+        rows.push_back((int)r);
+    }
+    return file;
+}
+
+#endif // D3T_DATASET_FILE_H
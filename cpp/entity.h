@@ -8,124 +8,421 @@
 #ifndef D3T_ENTITY_H
 #define D3T_ENTITY_H
 
+#include "binned.h"
+#include "bitmap.h"
+#include "counts.h"
+#include "dataset_file.h"
+#include "histogram.h"
 #include "noise.h"
 #include "split.h"
+#include "thread_pool.h"
 #include "utils.h"
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
-class EntityNode {
+// rows per block in the counting kernels
+constexpr size_t COUNT_BLOCK_SIZE = 1024;
+
+class EntityOptions {
 public:
-    EntityNode(int id) : id(id), isLeaf(true)
+    // evaluate every split on every row once and count nodes with AND + popcount
+    bool splitBitmaps = false;
+    // keep each row's bin among the thresholds of each threshold group of
+    // the splitting class, and the hot column of each one-hot block, and
+    // count and split those groups from the bins, see BinnedFeatures
+    bool binnedFeatures = false;
+    // memory for the exact count tensors kept between queries, see
+    // Entity::classTensor; 0 turns the cache off
+    size_t tensorCacheBytes = (size_t)256 << 20;
+    // nodes with at least this many rows are scanned in chunks on the
+    // entity's thread pool, see Entity::setThreadPool
+    size_t parallelScanRows = 32768;
+    // keep only the row indices in memory and stream the rows from the
+    // dataset file on every scan, see Entity's DatasetFileReader constructor
+    bool streamRows = false;
+    // rows of the file read at a time when streaming
+    size_t streamChunkRows = (size_t)1 << 16;
+    // chunks read ahead of the scan when streaming, 0 to read in line
+    size_t streamReadAhead = 2;
+    // draw the noise of each query from a counter-based generator keyed by
+    // the seed, entity and what the query asks, a whole tensor per call,
+    // instead of one count at a time from a sequential stream, so the order
+    // of queries does not matter, see Noise::laplaceBatch. This changes the
+    // results: for a given seed the noise differs from the sequential
+    // stream's.
+    bool counterNoise = false;
+};
+
+/*
+ * The rows of a node are rows_[begin, end) of its entity. Splitting a node
+ * partitions that range in place, so nodes own no index storage.
+ */
+struct EntityNode {
+    int size() const
     {
+        return end - begin;
     }
 
-    const int id;
+    int begin;
+    int end;
+    // -1 for the root
+    int parent;
     bool isLeaf;
-    std::vector<int> idxs;
-    std::unordered_map<int, std::shared_ptr<EntityNode>> children;
+    // child id per branch of the split, -1 for branches the split lacks
+    std::vector<int> children;
+    // identifies the node by its path from the root, see childNoiseKey
+    uint64_t noiseKey = 0;
+};
+
+/*
+ * Noised statistics of one node for a list of candidate splits, as returned
+ * by Entity::getNodeStatistics.
+ */
+class NodeStatistics {
+public:
+    // per candidate, [branch][label] as in Entity::getSplitLabelCounts
+    std::vector<std::vector<float>> splitLabelCounts;
+    // per candidate, as in Entity::getSplitCounts; empty if not requested
+    std::vector<std::vector<float>> splitCounts;
+    std::vector<float> labelCounts;
 };
 
-class Entity {
+/*
+ * The queries the coordinator makes to an entity. Entity answers them in
+ * process and RemoteEntity forwards them to an entity in another process.
+ * Splits are always members of the splitting class both sides agree on.
+ */
+class EntityInterface {
 public:
+    virtual ~EntityInterface() = default;
+
+    // only meaningful for entities in this process
+    virtual void setThreadPool(std::shared_ptr<ThreadPool> /*pool*/) {}
+
+    virtual void splitLeafWithFn(int id, const std::shared_ptr<Split>& splitFn) = 0;
+
+    // splitLeafWithFn(ids[i], splitFns[i]) for every i, in order
+    virtual void splitLeaves(const std::vector<int>& ids,
+                             const std::vector<std::shared_ptr<Split>>& splitFns)
+    {
+        assert(ids.size() == splitFns.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            splitLeafWithFn(ids[i], splitFns[i]);
+        }
+    }
+
+    virtual void prefetchChildren(int id) const = 0;
+    virtual void countLeaves(const std::vector<int>& ids) const = 0;
+    virtual NodeStatistics getNodeStatistics(int id,
+                                             const std::vector<std::shared_ptr<Split>>& splits,
+                                             float splitLabelEps,
+                                             float splitEps,
+                                             float labelEps,
+                                             bool withSplitCounts = true) const = 0;
+    virtual std::vector<float> getLabelCounts(int id, float privacyEps) const = 0;
+    virtual float getTotalCount(int id, float privacyEps) const = 0;
+    virtual std::tuple<std::shared_ptr<Split>, float> localRNM(int id,
+                                                               float privacyEps) const = 0;
+};
+
+/*
+ * A piece of the rows of one of the ranges of rows_ that Entity::scanRanges
+ * was given: the rows at positions [offset, offset + n) of range, as the
+ * indices idxs into data.
+ */
+struct RowPiece {
+    size_t range;
+    size_t offset;
+    const Dataset* data;
+    const int* idxs;
+    size_t n;
+};
+
+// an exact class tensor in the cache of an entity, possibly still being
+// counted, see Entity::classTensor
+using ClassTensorFuture = std::shared_future<std::shared_ptr<const CountTensor>>;
+
+class Entity : public EntityInterface {
+public:
+    /*
+     * The entity owns rows (increasing) of data, which it may share with
+     * other entities, e.g. a mapped dataset file; splitBitmaps and
+     * binnedFeatures, if given, must cover data and be built from
+     * splittingClass.
+     */
+    Entity(bool turnOffNoise,
+           int entityIdx,
+           int seed,
+           Dataset data,
+           std::vector<int> rows,
+           std::vector<std::shared_ptr<Split>> splittingClass,
+           std::shared_ptr<SplittingCriterion> splittingCriterion,
+           const EntityOptions& options = EntityOptions(),
+           std::shared_ptr<const SplitBitmaps> splitBitmaps = nullptr,
+           std::shared_ptr<const BinnedFeatures> binnedFeatures = nullptr)
+        : Entity(turnOffNoise, entityIdx, seed, std::move(data), nullptr, std::move(rows),
+                 std::move(splittingClass), std::move(splittingCriterion), options,
+                 std::move(splitBitmaps), std::move(binnedFeatures))
+    {
+    }
+
+    /*
+     * An entity whose rows stay in file: only their indices (increasing) are
+     * kept in memory, and every scan streams the chunks of
+     * options.streamChunkRows file rows that hold rows of the nodes scanned,
+     * reading options.streamReadAhead chunks ahead. A pass over the file
+     * counts all leaves given to countLeaves, and one splits all leaves given
+     * to splitLeaves, so this suits level-wise training best. Split bitmaps
+     * and binned features would take memory per row and are not used.
+     */
+    Entity(bool turnOffNoise,
+           int entityIdx,
+           int seed,
+           std::shared_ptr<const DatasetFileReader> file,
+           std::vector<int> rows,
+           std::vector<std::shared_ptr<Split>> splittingClass,
+           std::shared_ptr<SplittingCriterion> splittingCriterion,
+           const EntityOptions& options = EntityOptions())
+        : Entity(turnOffNoise, entityIdx, seed, Dataset(), std::move(file), std::move(rows),
+                 std::move(splittingClass), std::move(splittingCriterion), options, nullptr,
+                 nullptr)
+    {
+    }
+
+private:
     Entity(bool turnOffNoise,
            int entityIdx,
            int seed,
-           std::vector<std::vector<float>> data,
-           std::vector<int> labels,
+           Dataset data,
+           std::shared_ptr<const DatasetFileReader> file,
+           std::vector<int> rows,
            std::vector<std::shared_ptr<Split>> splittingClass,
-           std::shared_ptr<SplittingCriterion> splittingCriterion)
-        : privacyNoise_(entityIdx + seed, turnOffNoise),
-          data_(data),
-          labels_(labels),
+           std::shared_ptr<SplittingCriterion> splittingCriterion,
+           const EntityOptions& options,
+           std::shared_ptr<const SplitBitmaps> splitBitmaps,
+           std::shared_ptr<const BinnedFeatures> binnedFeatures)
+        : privacyNoise_(seed, entityIdx, turnOffNoise, options.counterNoise),
+          data_(std::move(data)),
+          file_(std::move(file)),
+          rows_(std::move(rows)),
           splittingClass(std::move(splittingClass)),
           splittingCriterion(std::move(splittingCriterion)),
-          root(std::make_shared<EntityNode>(0))
+          splitBitmaps_(std::move(splitBitmaps)),
+          binnedFeatures_(std::move(binnedFeatures)),
+          tensorCacheBytes_(options.tensorCacheBytes),
+          cachedTensorBytes_(0),
+          parallelScanRows_(options.parallelScanRows),
+          streamChunkRows_(std::max(options.streamChunkRows, (size_t)1)),
+          streamReadAhead_(options.streamReadAhead)
     {
-        for (size_t i = 0; i < data.size(); i++) {
-            root->idxs.push_back((int)i);
+        numBranches_ = 1;
+        for (size_t i = 0; i < Entity::splittingClass.size(); i++) {
+            splitIdx_.insert({Entity::splittingClass[i]->id, (int)i});
+            kernels_.push_back(makeSplitKernel(Entity::splittingClass[i]));
+            numBranches_ = std::max(numBranches_, splitBranches(Entity::splittingClass[i]));
         }
-        id2node_.push_back(root);
-        assert(data.size() == labels.size());
-        INFO_PRINTF("Constructed entity %d with %zu data points\n", entityIdx,
-                    data.size());
+        splitGroups_ = std::make_shared<const SplitGroups>(Entity::splittingClass);
+        size_t numRows = data_.numRows;
+        if (file_ != nullptr) {
+            assert(file_->ok());
+            numRows = file_->header.numRows;
+            if (options.splitBitmaps) {
+                WARNING_PRINTF("Entity %d streams its rows and does not use split bitmaps\n",
+                               entityIdx);
+            }
+            if (options.binnedFeatures) {
+                WARNING_PRINTF("Entity %d streams its rows and does not bin its features\n",
+                               entityIdx);
+            }
+        }
+        else {
+            if (options.splitBitmaps && splitBitmaps_ == nullptr) {
+                splitBitmaps_ = std::make_shared<const SplitBitmaps>(
+                    data_, Entity::splittingClass, Entity::splittingCriterion->numLabels);
+            }
+            if (options.binnedFeatures && binnedFeatures_ == nullptr) {
+                binnedFeatures_ =
+                    std::make_shared<const BinnedFeatures>(data_, Entity::splittingClass);
+            }
+        }
+        assert(splitBitmaps_ == nullptr || splitBitmaps_->numRows == data_.numRows);
+        assert(binnedFeatures_ == nullptr ||
+               (binnedFeatures_->numRows == data_.numRows &&
+                binnedFeatures_->numSplits == Entity::splittingClass.size()));
+        // nodes keep their rows in this order, as the bitmaps and streaming need
+        assert(std::is_sorted(rows_.begin(), rows_.end()));
+        assert(rows_.empty() || (rows_.front() >= 0 && (size_t)rows_.back() < numRows));
+        nodes_.push_back(EntityNode{0, (int)rows_.size(), -1, true, {}});
+        INFO_PRINTF("Constructed entity %d with %zu data points\n", entityIdx, rows_.size());
     }
 
+public:
     /*
-     * Split leaf with given split function
+     * Large nodes are scanned and partitioned on pool. Calls made from a
+     * task of the same pool, e.g. when the coordinator queries several
+     * entities at once, stay on their thread.
      */
-    void splitLeafWithFn(int id, const std::shared_ptr<Split>& splitFn)
+    void setThreadPool(std::shared_ptr<ThreadPool> pool) override
     {
-        std::shared_ptr<EntityNode> node = id2node_[id];
-        assert(node->isLeaf);
+        threadPool_ = std::move(pool);
+    }
 
-        for (size_t i = 0; i < splitFn->labels.size(); i++) {
-            std::shared_ptr<EntityNode> child =
-                std::make_shared<EntityNode>((int)id2node_.size());
-            id2node_.push_back(child);
+    // whether id is a node of this entity, for ids that come off the wire
+    bool hasNode(int id) const
+    {
+        return id >= 0 && (size_t)id < nodes_.size();
+    }
 
-            int label = splitFn->labels[i];
-            assert(node->children.find(label) == node->children.end());
-            node->children.insert({label, child});
-        }
+    bool hasLeaf(int id) const
+    {
+        return hasNode(id) && nodes_[id].isLeaf;
+    }
 
-        for (size_t i = 0; i < node->idxs.size(); i++) {
-            int label = splitFn->applySplit(data_[node->idxs[i]]);
-            assert(node->children.find(label) != node->children.end());
-            node->children[label]->idxs.push_back(node->idxs[i]);
+    /*
+     * Split leaf with given split function. The leaf's range of rows_ is
+     * stably partitioned by branch, and child i (in the order of
+     * splitFn->labels) gets id nodes_.size() + i.
+     */
+    void splitLeafWithFn(int id, const std::shared_ptr<Split>& splitFn) override
+    {
+        splitLeaves({id}, {splitFn});
+    }
+
+    /*
+     * The branches of all the leaves' rows are found in one scan, then each
+     * leaf is split in turn as by splitLeafWithFn.
+     */
+    void splitLeaves(const std::vector<int>& ids,
+                     const std::vector<std::shared_ptr<Split>>& splitFns) override
+    {
+        assert(ids.size() == splitFns.size());
+        std::vector<std::pair<int, int>> ranges;
+        std::vector<SplitKernel> kernels;
+        std::vector<int> bins;
+        std::vector<std::vector<uint8_t>> branches;
+        for (size_t k = 0; k < ids.size(); k++) {
+            assert(nodes_[ids[k]].isLeaf);
+            ranges.push_back(nodeRange(ids[k]));
+            kernels.push_back(splitKernel(splitFns[k]));
+            bins.push_back(splitBin(splitFns[k]));
+            branches.emplace_back(nodes_[ids[k]].size());
         }
+        scanRanges(ranges, [&](const std::vector<RowPiece>& pieces) {
+            runTasks(pieces.size(), [&](size_t p) {
+                const RowPiece& piece = pieces[p];
+                applySplitBatch(kernels[piece.range], bins[piece.range], *piece.data,
+                                piece.idxs, piece.n,
+                                branches[piece.range].data() + piece.offset);
+            });
+        });
+        for (size_t k = 0; k < ids.size(); k++) {
+            partitionLeaf(ids[k], splitFns[k], branches[k]);
+        }
+    }
 
-        node->isLeaf = false;
+    /*
+     * Noised counts per branch of splitFn, for branches 0..splitBranches(splitFn).
+     * Branches that no row of the node reaches stay 0 and get no noise.
+     */
+    std::vector<float> getSplitCounts(int id,
+                                      const std::shared_ptr<Split>& splitFn,
+                                      float privacyEps) const
+    {
+        int numBranches = splitBranches(splitFn);
+        std::vector<float> noise =
+            queryNoise(id, NoiseQuery::SplitCounts, numBranches, 1.0 / privacyEps, {splitFn});
+        return noisedSplitCounts(countTensor(id, {splitFn}), 0, numBranches, privacyEps,
+                                 noise.empty() ? nullptr : noise.data());
     }
 
-    std::unordered_map<int, float> getSplitCounts(int id,
-                                                   const std::shared_ptr<Split>& splitFn,
-                                                   float privacyEps) const
+    /*
+     * Noised counts per (branch, label) of splitFn, as [branch][label]. Empty
+     * cells stay 0 and get no noise.
+     */
+    std::vector<float> getSplitLabelCounts(int id,
+                                           const std::shared_ptr<Split>& splitFn,
+                                           float privacyEps) const
     {
-        std::unordered_map<int, float> noisedCounts;
-        for (auto& split2count : splitCounts(id, splitFn)) {
-            float noisedCount =
-                split2count.second + privacyNoise_.laplace(1.0 / privacyEps);
-            noisedCounts.insert({split2count.first, clipCount(noisedCount)});
-        }
-        return noisedCounts;
+        int numBranches = splitBranches(splitFn);
+        CountTensor tensor = countTensor(id, {splitFn});
+        std::vector<float> noise = queryNoise(id, NoiseQuery::SplitLabelCounts,
+                                              (size_t)numBranches * tensor.numLabels,
+                                              1.0 / privacyEps, {splitFn});
+        return noisedSplitLabelCounts(tensor, 0, numBranches, privacyEps,
+                                      noise.empty() ? nullptr : noise.data());
     }
 
-    std::unordered_map<int, std::unordered_map<int, float>> getSplitLabelCounts(
-        int id, const std::shared_ptr<Split>& splitFn, float privacyEps) const
+    /*
+     * Noised counts per label, labels without rows stay 0 and get no noise.
+     */
+    std::vector<float> getLabelCounts(int id, float privacyEps) const override
     {
-        std::unordered_map<int, std::unordered_map<int, float>> result;
-        for (auto& split2labelCount : splitLabelCounts(id, splitFn)) {
-            result.insert({split2labelCount.first, {}});
-            for (auto& label2count : split2labelCount.second) {
-                float noisedCount =
-                    label2count.second + privacyNoise_.laplace(1.0 / privacyEps);
-                result[split2labelCount.first].insert(
-                    {label2count.first, clipCount(noisedCount)});
-            }
-        }
-        return result;
+        std::vector<int> counts = labelCounts(id);
+        std::vector<float> noise =
+            queryNoise(id, NoiseQuery::LabelCounts, counts.size(), 1.0 / privacyEps);
+        return noisedLabelCounts(counts, privacyEps, noise.empty() ? nullptr : noise.data());
     }
 
-    std::unordered_map<int, float> getLabelCounts(int id, float privacyEps) const
+    /*
+     * Everything privateSplit needs from this entity at node id, from one
+     * scan: for each split, getSplitLabelCounts with splitLabelEps and then,
+     * if withSplitCounts, getSplitCounts with splitEps, and at last
+     * getLabelCounts with labelEps. Noise is drawn in that order, as if the
+     * queries had been made one by one; counter-based noise is the same as
+     * theirs too.
+     */
+    NodeStatistics getNodeStatistics(int id,
+                                     const std::vector<std::shared_ptr<Split>>& splits,
+                                     float splitLabelEps,
+                                     float splitEps,
+                                     float labelEps,
+                                     bool withSplitCounts = true) const override
     {
-        std::unordered_map<int, float> result;
-        for (auto& label2count : labelCounts(id)) {
-            float noisedCount =
-                label2count.second + privacyNoise_.laplace(1.0 / privacyEps);
-            result.insert({label2count.first, clipCount(noisedCount)});
+        NodeStatistics result;
+        CountTensor tensor = splits.empty() ? CountTensor(0, 0, 0) : countTensor(id, splits);
+        size_t splitLabelCells = (size_t)tensor.numBranches * tensor.numLabels;
+        std::vector<float> splitLabelNoise = queryNoise(
+            id, NoiseQuery::SplitLabelCounts, splitLabelCells, 1.0 / splitLabelEps, splits);
+        std::vector<float> splitNoise;
+        if (withSplitCounts) {
+            splitNoise =
+                queryNoise(id, NoiseQuery::SplitCounts, tensor.numBranches, 1.0 / splitEps, splits);
+        }
+        for (size_t i = 0; i < splits.size(); i++) {
+            int numBranches = splitBranches(splits[i]);
+            result.splitLabelCounts.push_back(noisedSplitLabelCounts(
+                tensor, (int)i, numBranches, splitLabelEps,
+                splitLabelNoise.empty() ? nullptr : splitLabelNoise.data() + i * splitLabelCells));
+            if (withSplitCounts) {
+                result.splitCounts.push_back(noisedSplitCounts(
+                    tensor, (int)i, numBranches, splitEps,
+                    splitNoise.empty() ? nullptr : splitNoise.data() + i * tensor.numBranches));
+            }
         }
+        std::vector<int> counts = splits.empty() ? labelCounts(id) : tensor.labelCounts();
+        std::vector<float> labelNoise =
+            queryNoise(id, NoiseQuery::LabelCounts, counts.size(), 1.0 / labelEps);
+        result.labelCounts =
+            noisedLabelCounts(counts, labelEps, labelNoise.empty() ? nullptr : labelNoise.data());
         return result;
     }
 
-    float getTotalCount(int id, float privacyEps) const
+    float getTotalCount(int id, float privacyEps) const override
     {
-        float noisedCount = totalCount(id) + privacyNoise_.laplace(1.0 / privacyEps);
+        std::vector<float> noise = queryNoise(id, NoiseQuery::TotalCount, 1, 1.0 / privacyEps);
+        float noisedCount =
+            totalCount(id) + drawNoise(noise.empty() ? nullptr : noise.data(), 0, 1.0 / privacyEps);
         if (noisedCount < 0.) {
             return 0.;
-        } else if (noisedCount > (float)data_.size()) {
-            return (float)data_.size();
+        } else if (noisedCount > (float)rows_.size()) {
+            return (float)rows_.size();
         } else {
             return noisedCount;
         }
@@ -134,38 +431,43 @@ public:
     /*
      * this returns the minimum conditional entropy one
      */
-    std::tuple<std::shared_ptr<Split>, float> localRNM(int id, float privacyEps) const
+    std::tuple<std::shared_ptr<Split>, float> localRNM(int id, float privacyEps) const override
     {
-        if (id2node_[id]->idxs.empty()) {
+        if (nodes_[id].size() == 0) {
             DEBUG_PRINTF("No data_ at leaf %d\n", id);
             return std::make_tuple(nullptr, std::numeric_limits<float>::quiet_NaN());
         }
 
-        std::unordered_map<int, int> labelCount = labelCounts(id);
-        float origG = splittingCriterion->calcG(labelCount);
+        // one pass over the node's rows counts every split in the class
+        std::shared_ptr<const CountTensor> classCounts = classTensor(id);
+        const CountTensor& tensor = *classCounts;
+        std::vector<int> labelCount = tensor.labelCounts();
+        float origG = splittingCriterion->calcG(
+            std::vector<float>(labelCount.begin(), labelCount.end()).data());
+
+        // the label counts of every (split, branch) are scored in one batch
+        std::vector<float> branchLabelCounts(tensor.counts.begin(), tensor.counts.end());
+        std::vector<float> branchG((size_t)tensor.numSplits * tensor.numBranches);
+        splittingCriterion->calcGBatch(branchLabelCounts.data(), branchG.size(), branchG.data());
 
-        int total = (int)id2node_[id]->idxs.size();
+        int total = nodes_[id].size();
         float minCondG = INT_MAX;
         std::shared_ptr<Split> bestSplit = nullptr;
+        float sensitivity = splittingCriterion->sensitivity(total);
+        std::vector<float> noise =
+            queryNoise(id, NoiseQuery::LocalRNM, splittingClass.size(), sensitivity / privacyEps);
         for (size_t i = 0; i < splittingClass.size(); i++) {
-            std::unordered_map<int, std::unordered_map<int, int>> splitLabelCounts_ =
-                splitLabelCounts(id, splittingClass[i]);
-            std::unordered_map<int, int> splitCounts_ =
-                splitCounts(id, splittingClass[i]);
             float condG = 0.0;
-            for (auto& split2labelCount : splitLabelCounts(id, splittingClass[i])) {
-                float innerG = splittingCriterion->calcG(split2labelCount.second);
-                if (splitCounts_.find(split2labelCount.first) == splitCounts_.end()) {
-//                    printLabelCounts(splitCounts_);
-//                    printSplitLabelCounts(splitLabelCounts_);
-                    assert(false);
+            for (int branch = 0; branch < tensor.numBranches; branch++) {
+                int splitCount = tensor.splitCount((int)i, branch);
+                if (splitCount > 0) {
+                    condG += (float)splitCount / total * branchG[i * tensor.numBranches + branch];
                 }
-                condG += (float)splitCounts_.at(split2labelCount.first) / total * innerG;
             }
 
             // get noise for condG based on RNM
-            float sensitivity = splittingCriterion->sensitivity(total);
-            float condGNoise = privacyNoise_.laplace(sensitivity / privacyEps);
+            float condGNoise =
+                drawNoise(noise.empty() ? nullptr : noise.data(), i, sensitivity / privacyEps);
             condG += condGNoise;
 
             // condG is positive
@@ -181,75 +483,771 @@ public:
         return std::make_tuple(bestSplit, infoGain);
     }
 
+    /*
+     * Counts the children of id exactly, ahead of their queries, into the
+     * tensor cache. No noise is drawn, so this never changes any result, and
+     * the entities can do it concurrently.
+     */
+    void prefetchChildren(int id) const override
+    {
+        for (int child : nodes_[id].children) {
+            if (child >= 0) {
+                classTensor(child, true);
+            }
+        }
+    }
+
+    /*
+     * Counts the leaves ids, e.g. a whole depth of the tree, into the tensor
+     * cache ahead of their queries, scanning all their rows in one parallel
+     * pass. Of the children of a cached parent, the largest is left out of
+     * the pass and derived by subtraction afterwards. Leaves that do not fit
+     * in the cache are counted when queried, as usual. No noise is drawn.
+     */
+    void countLeaves(const std::vector<int>& ids) const override
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex_);
+        // claimed in the cache before the scan, see classTensor
+        std::vector<int> scanned;
+        std::vector<std::promise<std::shared_ptr<const CountTensor>>> promises;
+        std::vector<int> derived;
+        std::vector<bool> visited(nodes_.size(), false);
+        auto scan = [&](int id) {
+            if (!visited[id] && classTensors_.count(id) == 0) {
+                std::promise<std::shared_ptr<const CountTensor>> promise;
+                if (claimClassTensor(id, promise.get_future().share())) {
+                    scanned.push_back(id);
+                    promises.push_back(std::move(promise));
+                }
+            }
+            visited[id] = true;
+        };
+        for (int id : ids) {
+            assert(nodes_[id].isLeaf);
+            int parent = nodes_[id].parent;
+            if (parent < 0 || classTensors_.count(parent) == 0) {
+                scan(id);
+                continue;
+            }
+            if (visited[id]) {
+                continue;
+            }
+            const std::vector<int>& siblings = nodes_[parent].children;
+            int largest = id;
+            for (int sibling : siblings) {
+                if (sibling >= 0 && nodes_[sibling].size() > nodes_[largest].size()) {
+                    largest = sibling;
+                }
+            }
+            for (int sibling : siblings) {
+                if (sibling >= 0 && sibling != largest) {
+                    scan(sibling);
+                }
+            }
+            visited[largest] = true;
+            derived.push_back(largest);
+        }
+        lock.unlock();
+
+        std::vector<CountTensor> tensors = scanClassTensors(scanned);
+        for (size_t k = 0; k < scanned.size(); k++) {
+            promises[k].set_value(std::make_shared<const CountTensor>(std::move(tensors[k])));
+        }
+        for (int id : derived) {
+            classTensor(id);
+        }
+    }
+
 private:
+    /*
+     * Partitions the leaf's range of rows_ stably by branches, the branch of
+     * each of its rows, and adds a child per branch of splitFn.
+     */
+    void partitionLeaf(int id,
+                       const std::shared_ptr<Split>& splitFn,
+                       const std::vector<uint8_t>& branches)
+    {
+        int begin = nodes_[id].begin;
+        int n = nodes_[id].size();
+        int numBranches = splitBranches(splitFn);
+        std::vector<size_t> bounds = chunkBounds(n);
+        size_t numChunks = bounds.size() - 1;
+        // chunkCounts[c * numBranches + b] = rows of chunk c in branch b
+        std::vector<int> chunkCounts(numChunks * numBranches, 0);
+        runTasks(numChunks, [&](size_t c) {
+            for (size_t j = bounds[c]; j < bounds[c + 1]; j++) {
+                assert(branches[j] < numBranches);
+                chunkCounts[c * numBranches + branches[j]]++;
+            }
+        });
+
+        // offsets[b] is where the rows of branch b start within the range, and
+        // the rows of chunk c follow those of the chunks before it
+        std::vector<int> offsets(numBranches + 1, 0);
+        std::vector<int> next(numChunks * numBranches);
+        for (int b = 0; b < numBranches; b++) {
+            offsets[b + 1] = offsets[b];
+            for (size_t c = 0; c < numChunks; c++) {
+                next[c * numBranches + b] = offsets[b + 1];
+                offsets[b + 1] += chunkCounts[c * numBranches + b];
+            }
+        }
+        std::vector<int> partitioned(n);
+        runTasks(numChunks, [&](size_t c) {
+            for (size_t j = bounds[c]; j < bounds[c + 1]; j++) {
+                partitioned[next[c * numBranches + branches[j]]++] = rows_[begin + j];
+            }
+        });
+        std::copy(partitioned.begin(), partitioned.end(), rows_.begin() + begin);
+
+        std::vector<int> children(numBranches, -1);
+        uint32_t split = noiseSplitIndex(splitFn);
+        for (int label : splitFn->labels) {
+            assert(children[label] == -1);
+            children[label] = (int)nodes_.size();
+            nodes_.push_back(EntityNode{begin + offsets[label], begin + offsets[label + 1], id,
+                                        true, {},
+                                        childNoiseKey(nodes_[id].noiseKey, split, label)});
+        }
+        nodes_[id].children = std::move(children);
+        nodes_[id].isLeaf = false;
+    }
+
     float clipCount(float noisedCount) const
     {
         if (noisedCount < 1.0) {
             return 1.0;
-        } else if (noisedCount > (float)data_.size()) {
-            return (float)data_.size();
+        } else if (noisedCount > (float)rows_.size()) {
+            return (float)rows_.size();
         } else {
             return noisedCount;
         }
     }
 
-    std::unordered_map<int, int> splitCounts(int id, const std::shared_ptr<Split>& splitFn) const
+    /*
+     * With counter-based noise, the Laplace noise of scale b of cells
+     * [0, cells) of the query of kind about each of splits at node id, as
+     * [split][cell], or of the one query about no split if splits is empty.
+     * Otherwise empty, and drawNoise takes each draw from the sequential
+     * stream.
+     */
+    std::vector<float> queryNoise(int id,
+                                  NoiseQuery kind,
+                                  size_t cells,
+                                  float b,
+                                  const std::vector<std::shared_ptr<Split>>& splits = {}) const
     {
-        std::unordered_map<int, int> splitCounts;
-        for (size_t i = 0; i < id2node_[id]->idxs.size(); i++) {
-            int idx = id2node_[id]->idxs[i];
-            int split = splitFn->applySplit(data_[idx]);
-            if (splitCounts.find(split) == splitCounts.end()) {
-                splitCounts.insert({split, 0});
+        if (!privacyNoise_.counterBased()) {
+            return {};
+        }
+        uint64_t node = nodes_[id].noiseKey;
+        std::vector<float> noise(std::max(splits.size(), (size_t)1) * cells);
+        if (splits.empty()) {
+            privacyNoise_.laplaceBatch(b, node, kind, 0, cells, noise.data());
+        }
+        for (size_t i = 0; i < splits.size(); i++) {
+            privacyNoise_.laplaceBatch(b, node, kind, noiseSplitIndex(splits[i]), cells,
+                                       noise.data() + i * cells);
+        }
+        return noise;
+    }
+
+    /*
+     * splitFn's index into splittingClass, which identifies it in noise
+     * keys, or past the end for splits outside the class.
+     */
+    uint32_t noiseSplitIndex(const std::shared_ptr<Split>& splitFn) const
+    {
+        auto it = splitIdx_.find(splitFn->id);
+        if (it != splitIdx_.end()) {
+            return (uint32_t)it->second;
+        }
+        return (uint32_t)(splittingClass.size() + splitFn->id);
+    }
+
+    /*
+     * Noise of scale b for cell i of a query, from noise as queryNoise gave
+     * it, or the next draw of the stream if noise is null.
+     */
+    float drawNoise(const float* noise, size_t i, float b) const
+    {
+        return noise != nullptr ? noise[i] : privacyNoise_.laplace(b);
+    }
+
+    /*
+     * noise, if not null, holds the noise of each branch.
+     */
+    std::vector<float> noisedSplitCounts(const CountTensor& tensor,
+                                         int split,
+                                         int numBranches,
+                                         float privacyEps,
+                                         const float* noise) const
+    {
+        std::vector<float> result(numBranches, 0.0);
+        for (int branch = 0; branch < numBranches; branch++) {
+            int count = tensor.splitCount(split, branch);
+            if (count > 0) {
+                result[branch] = clipCount(count + drawNoise(noise, branch, 1.0 / privacyEps));
             }
-            splitCounts[split]++;
         }
-        return splitCounts;
+        return result;
     }
 
-    std::unordered_map<int, std::unordered_map<int, int>> splitLabelCounts(
-        int id, const std::shared_ptr<Split>& splitFn) const
+    /*
+     * noise, if not null, holds the noise of each (branch, label) as
+     * [branch][label].
+     */
+    std::vector<float> noisedSplitLabelCounts(const CountTensor& tensor,
+                                              int split,
+                                              int numBranches,
+                                              float privacyEps,
+                                              const float* noise) const
     {
-        std::unordered_map<int, std::unordered_map<int, int>> result;
-        for (size_t i = 0; i < id2node_[id]->idxs.size(); i++) {
-            int idx = id2node_[id]->idxs[i];
-            int split = splitFn->applySplit(data_[idx]);
-            if (result.find(split) == result.end()) {
-                result.insert({split, {}});
+        int numLabels = tensor.numLabels;
+        std::vector<float> result((size_t)numBranches * numLabels, 0.0);
+        for (size_t i = 0; i < result.size(); i++) {
+            int count = tensor.at(split, (int)i / numLabels, (int)i % numLabels);
+            if (count > 0) {
+                result[i] = clipCount(count + drawNoise(noise, i, 1.0 / privacyEps));
             }
-            if (result[split].find(labels_[idx]) == result[split].end()) {
-                result[split].insert({labels_[idx], 0});
+        }
+        return result;
+    }
+
+    /*
+     * noise, if not null, holds the noise of each label.
+     */
+    std::vector<float> noisedLabelCounts(const std::vector<int>& counts,
+                                         float privacyEps,
+                                         const float* noise) const
+    {
+        std::vector<float> result(counts.size(), 0.0);
+        for (size_t label = 0; label < counts.size(); label++) {
+            if (counts[label] > 0) {
+                result[label] =
+                    clipCount(counts[label] + drawNoise(noise, label, 1.0 / privacyEps));
             }
-            result[split][labels_[idx]]++;
         }
         return result;
     }
 
-    std::unordered_map<int, int> labelCounts(int id) const
+    /*
+     * Fills a [split][branch][label] count tensor for splits with a single
+     * pass over the rows of node id. Rows are taken in blocks so that each
+     * split streams through the columns it reads while the block's labels
+     * stay in cache.
+     */
+    CountTensor countTensor(int id, const std::vector<std::shared_ptr<Split>>& splits) const
     {
-        std::unordered_map<int, int> result;
-        for (size_t i = 0; i < id2node_[id]->idxs.size(); i++) {
-            int idx = id2node_[id]->idxs[i];
-            if (result.find(labels_[idx]) == result.end()) {
-                result.insert({labels_[idx], 0});
+        std::vector<int> splitIdxs;
+        for (const std::shared_ptr<Split>& splitFn : splits) {
+            auto it = splitIdx_.find(splitFn->id);
+            if (it == splitIdx_.end()) {
+                break;
+            }
+            splitIdxs.push_back(it->second);
+        }
+        if (splitIdxs.size() == splits.size()) {
+            std::shared_ptr<const CountTensor> tensor = classTensor(id, true);
+            if (tensor != nullptr) {
+                return tensor->select(splitIdxs);
+            }
+            if (splitBitmaps_ != nullptr) {
+                return scanNode(id, [&](const Dataset&, const int* idxs, size_t size) {
+                    return splitBitmaps_->countTensor(idxs, size, splitIdxs);
+                });
+            }
+        }
+
+        int numBranches = 0;
+        for (const std::shared_ptr<Split>& splitFn : splits) {
+            numBranches = std::max(numBranches, splitBranches(splitFn));
+        }
+        std::vector<SplitKernel> kernels;
+        std::vector<int> bins;
+        for (const std::shared_ptr<Split>& splitFn : splits) {
+            kernels.push_back(splitKernel(splitFn));
+            bins.push_back(splitBin(splitFn));
+        }
+        return scanNode(id, [&](const Dataset& data, const int* idxs, size_t size) {
+            CountTensor tensor((int)splits.size(), numBranches, splittingCriterion->numLabels);
+            int labels[COUNT_BLOCK_SIZE];
+            uint8_t branches[COUNT_BLOCK_SIZE];
+            for (size_t blockBegin = 0; blockBegin < size; blockBegin += COUNT_BLOCK_SIZE) {
+                size_t n = std::min(size - blockBegin, COUNT_BLOCK_SIZE);
+                for (size_t j = 0; j < n; j++) {
+                    labels[j] = data.label(idxs[blockBegin + j]);
+                }
+                for (size_t i = 0; i < splits.size(); i++) {
+                    applySplitBatch(kernels[i], bins[i], data, idxs + blockBegin, n, branches);
+                    for (size_t j = 0; j < n; j++) {
+                        tensor.at((int)i, branches[j], labels[j])++;
+                    }
+                }
+            }
+            return tensor;
+        });
+    }
+
+    /*
+     * Exact count tensor of the whole splitting class at node id, kept until
+     * the children of id are counted. The children of a node partition its
+     * rows, so once the parent's tensor is known only the smaller siblings
+     * are scanned and the largest one is the parent's tensor minus theirs.
+     * Tensors that would take the cache over tensorCacheBytes_ are not kept,
+     * and if ifCacheable, null is returned for them instead of scanning the
+     * whole class for nothing.
+     *
+     * Concurrent queries share the cache: cacheMutex_ is held only to look
+     * up, claim and erase entries, never across a scan. A node being counted
+     * is in the cache as a future, so a query for it, or for a sibling being
+     * scanned along with it, waits for that scan instead of repeating it.
+     */
+    std::shared_ptr<const CountTensor> classTensor(int id, bool ifCacheable = false) const
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex_);
+        auto it = classTensors_.find(id);
+        if (it != classTensors_.end()) {
+            ClassTensorFuture cached = it->second;
+            lock.unlock();
+            return cached.get();
+        }
+        int parent = nodes_[id].parent;
+        auto parentIt = parent >= 0 ? classTensors_.find(parent) : classTensors_.end();
+        if (parentIt == classTensors_.end()) {
+            std::promise<std::shared_ptr<const CountTensor>> promise;
+            if (!claimClassTensor(id, promise.get_future().share()) && ifCacheable) {
+                return nullptr;
+            }
+            lock.unlock();
+            std::shared_ptr<const CountTensor> tensor =
+                std::make_shared<const CountTensor>(scanClassTensor(id));
+            promise.set_value(tensor);
+            return tensor;
+        }
+
+        const std::vector<int>& siblings = nodes_[parent].children;
+        int largest = id;
+        for (int sibling : siblings) {
+            if (sibling >= 0 && nodes_[sibling].size() > nodes_[largest].size()) {
+                largest = sibling;
+            }
+        }
+        ClassTensorFuture parentTensor = parentIt->second;
+        cachedTensorBytes_ -= classTensorBytes();
+        classTensors_.erase(parentIt);
+
+        // every sibling not yet cached is claimed, so that queries for them
+        // wait for this derivation; siblings of multiway splits are scanned
+        // side by side
+        std::vector<ClassTensorFuture> tensors(siblings.size());
+        std::vector<int> scanned;
+        std::vector<std::promise<std::shared_ptr<const CountTensor>>> promises;
+        std::promise<std::shared_ptr<const CountTensor>> largestPromise;
+        bool deriveLargest = false;
+        for (size_t k = 0; k < siblings.size(); k++) {
+            int sibling = siblings[k];
+            if (sibling < 0) {
+                continue;
+            }
+            auto siblingIt = classTensors_.find(sibling);
+            if (siblingIt != classTensors_.end()) {
+                tensors[k] = siblingIt->second;
+                continue;
+            }
+            std::promise<std::shared_ptr<const CountTensor>> promise;
+            tensors[k] = promise.get_future().share();
+            claimClassTensor(sibling, tensors[k]);
+            if (sibling == largest) {
+                largestPromise = std::move(promise);
+                deriveLargest = true;
+            }
+            else {
+                scanned.push_back(sibling);
+                promises.push_back(std::move(promise));
+            }
+        }
+        lock.unlock();
+
+        std::vector<CountTensor> scannedTensors = scanClassTensors(scanned);
+        for (size_t k = 0; k < scanned.size(); k++) {
+            promises[k].set_value(
+                std::make_shared<const CountTensor>(std::move(scannedTensors[k])));
+        }
+        std::shared_ptr<const CountTensor> result;
+        if (deriveLargest) {
+            CountTensor rest = *parentTensor.get();
+            for (size_t k = 0; k < siblings.size(); k++) {
+                if (siblings[k] >= 0 && siblings[k] != largest) {
+                    rest.subtract(*tensors[k].get());
+                }
+            }
+            largestPromise.set_value(std::make_shared<const CountTensor>(std::move(rest)));
+        }
+        for (size_t k = 0; k < siblings.size(); k++) {
+            if (siblings[k] == id) {
+                result = tensors[k].get();
             }
-            result[labels_[idx]]++;
         }
         return result;
     }
 
+    size_t classTensorBytes() const
+    {
+        return splittingClass.size() * numBranches_ * splittingCriterion->numLabels * sizeof(int);
+    }
+
+    /*
+     * Enters id, which must not be cached yet, into the cache as tensor if
+     * it fits, and returns whether it does. Needs cacheMutex_.
+     */
+    bool claimClassTensor(int id, const ClassTensorFuture& tensor) const
+    {
+        if (cachedTensorBytes_ + classTensorBytes() > tensorCacheBytes_) {
+            return false;
+        }
+        classTensors_.insert({id, tensor});
+        cachedTensorBytes_ += classTensorBytes();
+        return true;
+    }
+
+    /*
+     * Count tensor of the whole splitting class at node id. Threshold splits
+     * on the same attributes are counted together from one histogram of the
+     * attribute sum; the remaining splits go through their kernels.
+     */
+    CountTensor scanClassTensor(int id) const
+    {
+        return scanClassTensors({id})[0];
+    }
+
+    // scanClassTensor of each of ids, from one scan
+    std::vector<CountTensor> scanClassTensors(const std::vector<int>& ids) const
+    {
+        std::vector<std::pair<int, int>> ranges;
+        for (int id : ids) {
+            ranges.push_back(nodeRange(id));
+        }
+        return countRanges(ranges, [this](const Dataset& data, const int* idxs, size_t size) {
+            return scanClassTensor(data, idxs, size);
+        });
+    }
+
+    CountTensor scanClassTensor(const Dataset& data, const int* idxs, size_t size) const
+    {
+        if (splitBitmaps_ != nullptr) {
+            std::vector<int> splitIdxs;
+            for (size_t i = 0; i < splittingClass.size(); i++) {
+                splitIdxs.push_back((int)i);
+            }
+            return splitBitmaps_->countTensor(idxs, size, splitIdxs);
+        }
+
+        int numLabels = splittingCriterion->numLabels;
+        CountTensor tensor((int)splittingClass.size(), numBranches_, numLabels);
+        // one histogram per field of binnedFeatures_, else per threshold group
+        std::vector<std::vector<int>> hists;
+        if (binnedFeatures_ != nullptr) {
+            for (size_t f = 0; f < binnedFeatures_->numFields(); f++) {
+                hists.emplace_back((size_t)binnedFeatures_->numBins(f) * numLabels, 0);
+            }
+        }
+        else {
+            for (const ThresholdGroup& group : splitGroups_->groups) {
+                hists.emplace_back((size_t)group.numBins() * numLabels, 0);
+            }
+        }
+        int labels[COUNT_BLOCK_SIZE];
+        uint8_t branches[COUNT_BLOCK_SIZE];
+        for (size_t blockBegin = 0; blockBegin < size; blockBegin += COUNT_BLOCK_SIZE) {
+            size_t n = std::min(size - blockBegin, COUNT_BLOCK_SIZE);
+            const int* rows = idxs + blockBegin;
+            for (size_t j = 0; j < n; j++) {
+                labels[j] = data.label(rows[j]);
+            }
+            if (binnedFeatures_ != nullptr) {
+                for (size_t f = 0; f < binnedFeatures_->numFields(); f++) {
+                    binnedFeatures_->accumulate(f, rows, labels, n, numLabels, hists[f].data());
+                }
+            }
+            else {
+                for (size_t g = 0; g < splitGroups_->groups.size(); g++) {
+                    splitGroups_->groups[g].accumulate(data, rows, labels, n, numLabels,
+                                                       hists[g].data());
+                }
+            }
+            for (int i : splitGroups_->ungrouped) {
+                applySplitKernelBatch(kernels_[i], data, rows, n, branches);
+                for (size_t j = 0; j < n; j++) {
+                    tensor.at(i, branches[j], labels[j])++;
+                }
+            }
+        }
+        if (binnedFeatures_ != nullptr) {
+            for (size_t f = 0; f < binnedFeatures_->numFields(); f++) {
+                binnedFeatures_->fillTensor(f, hists[f].data(), numLabels, tensor);
+            }
+        }
+        else {
+            for (size_t g = 0; g < splitGroups_->groups.size(); g++) {
+                splitGroups_->groups[g].fillTensor(hists[g].data(), numLabels, tensor);
+            }
+        }
+        return tensor;
+    }
+
+    std::pair<int, int> nodeRange(int id) const
+    {
+        return std::make_pair(nodes_[id].begin, nodes_[id].end);
+    }
+
+    SplitKernel splitKernel(const std::shared_ptr<Split>& splitFn) const
+    {
+        auto it = splitIdx_.find(splitFn->id);
+        if (it != splitIdx_.end()) {
+            return kernels_[it->second];
+        }
+        return makeSplitKernel(splitFn);
+    }
+
+    /*
+     * The index of splitFn in the splitting class if binnedFeatures_ holds
+     * its bins, else -1.
+     */
+    int splitBin(const std::shared_ptr<Split>& splitFn) const
+    {
+        if (binnedFeatures_ == nullptr) {
+            return -1;
+        }
+        auto it = splitIdx_.find(splitFn->id);
+        if (it != splitIdx_.end() && binnedFeatures_->binned(it->second)) {
+            return it->second;
+        }
+        return -1;
+    }
+
+    /*
+     * applySplitKernelBatch, from the bins if bin is a split's splitBin.
+     */
+    void applySplitBatch(const SplitKernel& kernel,
+                         int bin,
+                         const Dataset& data,
+                         const int* idxs,
+                         size_t n,
+                         uint8_t* out) const
+    {
+        if (bin >= 0) {
+            binnedFeatures_->applySplit(bin, idxs, n, out);
+        }
+        else {
+            applySplitKernelBatch(kernel, data, idxs, n, out);
+        }
+    }
+
+    std::vector<int> labelCounts(int id) const
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex_);
+        auto it = classTensors_.find(id);
+        if (it != classTensors_.end()) {
+            ClassTensorFuture cached = it->second;
+            lock.unlock();
+            return cached.get()->labelCounts();
+        }
+        lock.unlock();
+        return scanNode(id, [this](const Dataset& data, const int* idxs, size_t size) {
+                   CountTensor tensor(1, 1, splittingCriterion->numLabels);
+                   for (size_t i = 0; i < size; i++) {
+                       tensor.counts[data.label(idxs[i])]++;
+                   }
+                   return tensor;
+               })
+            .counts;
+    }
+
+    /*
+     * Boundaries of the chunks that a node of n rows is processed in, chunk
+     * c being rows [bounds[c], bounds[c + 1]). Nodes smaller than
+     * parallelScanRows_, or without a thread pool, are one chunk.
+     */
+    std::vector<size_t> chunkBounds(size_t n) const
+    {
+        size_t numChunks = 1;
+        if (threadPool_ != nullptr && n >= parallelScanRows_) {
+            numChunks = threadPool_->numThreads();
+        }
+        std::vector<size_t> bounds;
+        for (size_t c = 0; c <= numChunks; c++) {
+            bounds.push_back(n * c / numChunks);
+        }
+        return bounds;
+    }
+
+    // fn(i) for every i < numTasks, on the thread pool if there is one
+    void runTasks(size_t numTasks, const std::function<void(size_t)>& fn) const
+    {
+        if (threadPool_ != nullptr) {
+            threadPool_->parallelFor(numTasks, fn);
+        }
+        else {
+            for (size_t i = 0; i < numTasks; i++) {
+                fn(i);
+            }
+        }
+    }
+
+    /*
+     * batch(pieces) for batches of pieces that together cover the rows of
+     * ranges, each [begin, end) of rows_. In memory, one batch holds every
+     * range cut into chunks (see chunkBounds); when streaming, there is a
+     * batch per chunk of the file read, with the rows of each range in it cut
+     * the same way. Pieces of a batch may be processed in parallel.
+     */
+    template <typename Batch>
+    void scanRanges(const std::vector<std::pair<int, int>>& ranges, const Batch& batch) const
+    {
+        std::vector<RowPiece> pieces;
+        if (file_ == nullptr) {
+            for (size_t k = 0; k < ranges.size(); k++) {
+                std::vector<size_t> bounds = chunkBounds(ranges[k].second - ranges[k].first);
+                for (size_t c = 0; c + 1 < bounds.size(); c++) {
+                    pieces.push_back(RowPiece{k, bounds[c], &data_,
+                                              rows_.data() + ranges[k].first + bounds[c],
+                                              bounds[c + 1] - bounds[c]});
+                }
+            }
+            batch(pieces);
+            return;
+        }
+
+        // the span of each chunk of the file from the first to the last row
+        // the ranges need in it; the rows of a range are increasing, and
+        // large pieces are cut into chunks as in memory
+        size_t numChunks = (file_->header.numRows + streamChunkRows_ - 1) / streamChunkRows_;
+        std::vector<std::pair<size_t, size_t>> chunkSpans(numChunks, {SIZE_MAX, 0});
+        for (const std::pair<int, int>& range : ranges) {
+            for (int i = range.first; i < range.second; i++) {
+                std::pair<size_t, size_t>& span = chunkSpans[rows_[i] / streamChunkRows_];
+                span.first = std::min(span.first, (size_t)rows_[i]);
+                span.second = std::max(span.second, (size_t)rows_[i] + 1);
+            }
+        }
+        std::vector<std::pair<size_t, size_t>> spans;
+        for (const std::pair<size_t, size_t>& span : chunkSpans) {
+            if (span.first < span.second) {
+                spans.push_back(span);
+            }
+        }
+
+        RowSpanReader reader(file_, spans, streamReadAhead_);
+        std::vector<int> next;
+        for (const std::pair<int, int>& range : ranges) {
+            next.push_back(range.first);
+        }
+        std::vector<std::vector<int>> idxs(ranges.size());
+        for (const std::pair<size_t, size_t>& span : spans) {
+            Dataset chunk = reader.next();
+            pieces.clear();
+            for (size_t k = 0; k < ranges.size(); k++) {
+                idxs[k].clear();
+                size_t offset = next[k] - ranges[k].first;
+                while (next[k] < ranges[k].second && (size_t)rows_[next[k]] < span.second) {
+                    idxs[k].push_back(rows_[next[k]++] - (int)span.first);
+                }
+                if (idxs[k].empty()) {
+                    continue;
+                }
+                std::vector<size_t> bounds = chunkBounds(idxs[k].size());
+                for (size_t c = 0; c + 1 < bounds.size(); c++) {
+                    pieces.push_back(RowPiece{k, offset + bounds[c], &chunk,
+                                              idxs[k].data() + bounds[c],
+                                              bounds[c + 1] - bounds[c]});
+                }
+            }
+            batch(pieces);
+        }
+    }
+
+    /*
+     * For each of ranges, the sum of scan(data, idxs, n) over its pieces
+     * (see scanRanges), where scan counts into a fresh tensor.
+     */
+    template <typename Scan>
+    std::vector<CountTensor> countRanges(const std::vector<std::pair<int, int>>& ranges,
+                                         const Scan& scan) const
+    {
+        std::vector<CountTensor> totals(ranges.size(), CountTensor(0, 0, 0));
+        std::vector<bool> counted(ranges.size(), false);
+        scanRanges(ranges, [&](const std::vector<RowPiece>& pieces) {
+            std::vector<CountTensor> partial(pieces.size(), CountTensor(0, 0, 0));
+            runTasks(pieces.size(), [&](size_t p) {
+                partial[p] = scan(*pieces[p].data, pieces[p].idxs, pieces[p].n);
+            });
+            for (size_t p = 0; p < pieces.size(); p++) {
+                size_t k = pieces[p].range;
+                if (counted[k]) {
+                    totals[k].add(partial[p]);
+                }
+                else {
+                    totals[k] = std::move(partial[p]);
+                    counted[k] = true;
+                }
+            }
+        });
+        // streamed ranges without rows have no pieces
+        for (size_t k = 0; k < ranges.size(); k++) {
+            if (!counted[k]) {
+                totals[k] = scan(data_, nullptr, 0);
+            }
+        }
+        return totals;
+    }
+
+    /*
+     * scan(data, idxs, n) over the rows of node id, see countRanges. Large
+     * nodes are scanned chunk by chunk on the thread pool.
+     */
+    template <typename Scan>
+    CountTensor scanNode(int id, const Scan& scan) const
+    {
+        return countRanges({nodeRange(id)}, scan)[0];
+    }
+
     int totalCount(int id) const
     {
-        return id2node_[id]->idxs.size();
+        return nodes_[id].size();
     }
 
     mutable Noise privacyNoise_;
-    const std::vector<std::vector<float>> data_;
-    const std::vector<int> labels_;
-    std::vector<std::shared_ptr<EntityNode>> id2node_;
+    // empty if the rows are streamed from file_
+    const Dataset data_;
+    std::shared_ptr<const DatasetFileReader> file_;
+    // this entity's rows of data_ (or file_), permuted in place, see EntityNode
+    std::vector<int> rows_;
+    std::vector<EntityNode> nodes_;
     const std::vector<std::shared_ptr<Split>> splittingClass;
     const std::shared_ptr<SplittingCriterion> splittingCriterion;
-    const std::shared_ptr<EntityNode> root;
+    // split id -> index into splittingClass
+    std::unordered_map<int, int> splitIdx_;
+    // kernels_[i] evaluates splittingClass[i]
+    std::vector<SplitKernel> kernels_;
+    std::shared_ptr<const SplitGroups> splitGroups_;
+    // most branches of any split in splittingClass
+    int numBranches_;
+    std::shared_ptr<const SplitBitmaps> splitBitmaps_;
+    std::shared_ptr<const BinnedFeatures> binnedFeatures_;
+    // node id -> exact class tensor, or the scan that will produce it, see
+    // classTensor
+    mutable std::unordered_map<int, ClassTensorFuture> classTensors_;
+    size_t tensorCacheBytes_;
+    // of all entries of classTensors_, ready or not
+    mutable size_t cachedTensorBytes_;
+    // guards classTensors_ and cachedTensorBytes_, as the coordinator may
+    // query different nodes at once, see CoordinatorOptions::counterNoise
+    mutable std::mutex cacheMutex_;
+    std::shared_ptr<ThreadPool> threadPool_;
+    size_t parallelScanRows_;
+    size_t streamChunkRows_;
+    size_t streamReadAhead_;
 };
 
 #endif // D3T_ENTITY_H
@@ -0,0 +1,170 @@
+/** @file entity_server.cpp
+ *  @brief Serves entities to coordinators over RPC. Every connection starts
+ *         with an Init request naming the dataset and the partition to load
+ *         (see EntityServerConfig), and then gets its own entity until the
+ *         coordinator hangs up. Data is read from ../data like single_run.
+ *
+ *         usage: entity_server <unix:path | host:port> [numThreads]
+ */
+
+#include "run_helpers.h"
+
+#include <algorithm>
+#include <mutex>
+
+/*
+ * A training set with its training rows and, if the entities use them,
+ * split bitmaps and binned features over it or the dataset file to stream, shared by all
+ * entities of a run.
+ */
+class TrainingSet {
+public:
+    // empty if the rows are streamed from file
+    Dataset data;
+    std::vector<int> rows;
+    int numLabels;
+    std::shared_ptr<const SplitBitmaps> splitBitmaps;
+    std::shared_ptr<const BinnedFeatures> binnedFeatures;
+    std::shared_ptr<const DatasetFileReader> file;
+};
+
+/*
+ * Coordinators of one run connect once per entity, so the last loaded
+ * training set is kept for the next connection.
+ */
+std::shared_ptr<const TrainingSet> loadTrainingSet(const EntityServerConfig& config)
+{
+    static std::mutex mutex;
+    static std::string cachedKey;
+    static std::shared_ptr<const TrainingSet> cached;
+
+    std::string path = "../data/" + config.dataset + "_train";
+    std::string key = path + "-seed_" + std::to_string(config.seed) +
+                      "-trainingFraction_" + std::to_string(config.trainingFraction) +
+                      "-splitBitmaps_" + std::to_string(config.options.splitBitmaps) +
+                      "-binnedFeatures_" + std::to_string(config.options.binnedFeatures) +
+                      "-streamRows_" + std::to_string(config.options.streamRows);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cached == nullptr || cachedKey != key) {
+        std::shared_ptr<TrainingSet> loaded = std::make_shared<TrainingSet>();
+        if (config.options.streamRows) {
+            // only the row indices, as the rows may not fit in memory
+            loaded->file =
+                openStreamedDataset(loaded->rows, path, config.seed, config.trainingFraction);
+            loaded->numLabels = loaded->file != nullptr ? loaded->file->header.numLabels : 0;
+        }
+        else {
+            loaded->numLabels =
+                openDataset(loaded->data, loaded->rows, path, config.seed, config.trainingFraction);
+            if (loaded->numLabels > 0 && config.options.splitBitmaps) {
+                loaded->splitBitmaps = std::make_shared<const SplitBitmaps>(
+                    loaded->data, makeSplittingClass(config.dataset), loaded->numLabels);
+            }
+            if (loaded->numLabels > 0 && config.options.binnedFeatures) {
+                loaded->binnedFeatures = std::make_shared<const BinnedFeatures>(
+                    loaded->data, makeSplittingClass(config.dataset));
+            }
+        }
+        cached = loaded;
+        cachedKey = key;
+    }
+    return cached;
+}
+
+void serveConnection(int fd, std::shared_ptr<ThreadPool> pool)
+{
+    RpcHeader header;
+    std::vector<char> payload;
+    if (!readFrame(fd, header, payload) || header.method != (uint32_t)EntityMethod::Init) {
+        WARNING_PRINTF("Connection did not start with Init\n");
+        close(fd);
+        return;
+    }
+    WireReader request(payload);
+    request.get<int32_t>();
+    EntityServerConfig config;
+    bool ok = config.read(request);
+    if (!ok) {
+        WARNING_PRINTF("Client speaks another protocol version\n");
+    }
+    // the dataset name becomes a path, so only known ones are loaded
+    else if (!request.done() || !knownDataset(config.dataset) ||
+             !knownSplittingCriterion(config.splittingCriterionName)) {
+        WARNING_PRINTF("Malformed Init request\n");
+        ok = false;
+    }
+
+    std::shared_ptr<const TrainingSet> loaded;
+    if (ok) {
+        loaded = loadTrainingSet(config);
+        ok = loaded->numLabels > 0 && config.rowBegin >= 0 && config.rowBegin <= config.rowEnd &&
+             config.rowEnd <= (int)loaded->rows.size();
+        if (!ok) {
+            WARNING_PRINTF("Cannot serve rows [%d, %d) of %s\n", config.rowBegin,
+                           config.rowEnd, config.dataset.c_str());
+        }
+    }
+    WireWriter reply;
+    reply.put((uint8_t)ok);
+    if (!writeFrame(fd, 0, header.id, reply.buffer) || !ok) {
+        close(fd);
+        return;
+    }
+
+    std::vector<std::shared_ptr<Split>> splittingClass = makeSplittingClass(config.dataset);
+    std::vector<int> rows(loaded->rows.begin() + config.rowBegin,
+                          loaded->rows.begin() + config.rowEnd);
+    std::sort(rows.begin(), rows.end());
+    std::shared_ptr<SplittingCriterion> splittingCriterion =
+        makeSplittingCriterion(config.splittingCriterionName, loaded->numLabels);
+    Entity entity = loaded->file != nullptr
+                        ? Entity(config.turnOffNoise, config.entityIdx, config.seed, loaded->file,
+                                 std::move(rows), splittingClass, splittingCriterion,
+                                 config.options)
+                        : Entity(config.turnOffNoise, config.entityIdx, config.seed, loaded->data,
+                                 std::move(rows), splittingClass, splittingCriterion,
+                                 config.options, loaded->splitBitmaps,
+                                 loaded->binnedFeatures);
+    entity.setThreadPool(std::move(pool));
+    loaded = nullptr;
+    serveEntity(fd, entity, splittingClass);
+    INFO_PRINTF("Entity %d of %s disconnected\n", config.entityIdx, config.dataset.c_str());
+    close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    if (argc < 2) {
+        printf("usage: %s <unix:path | host:port> [numThreads]\n", argv[0]);
+        return 1;
+    }
+    std::string address(argv[1]);
+    int numThreads = argc > 2 ? std::stoi(std::string(argv[2])) : 1;
+
+    int listenFd = listenSocket(address);
+    if (listenFd < 0) {
+        return 1;
+    }
+    // shared by the entities of all connections for scanning large nodes
+    std::shared_ptr<ThreadPool> pool = std::make_shared<ThreadPool>(numThreads);
+    printf("Serving entities on %s with %d threads\n", address.c_str(), pool->numThreads());
+    fflush(stdout);
+
+    while (true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            WARNING_PRINTF("accept failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if (address.compare(0, 5, "unix:") != 0) {
+            rpc_detail::setNoDelay(fd);
+        }
+        // one thread per connection, as a coordinator keeps all of its
+        // entities' connections open at once
+        std::thread(serveConnection, fd, pool).detach();
+    }
+}
@@ -0,0 +1,220 @@
+/** @file flat_tree.h
+ *  @brief A trained tree compiled into one array of plain nodes for
+ *         scoring. Nodes are laid out breadth first, threshold splits are
+ *         stored inline, and rows are routed without touching the
+ *         CoordinatorNode graph, so scoring is cheap to run in parallel over
+ *         blocks of rows.
+ */
+
+#ifndef D3T_FLAT_TREE_H
+#define D3T_FLAT_TREE_H
+
+#include "coordinator.h"
+#include "split.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <vector>
+
+// rows per task when scoring in parallel
+constexpr size_t PREDICT_BLOCK_SIZE = 4096;
+
+enum class FlatSplitKind : uint8_t {
+    Leaf = 0,
+    // feature <= threshold
+    SingleThreshold = 1,
+    // sum of the features <= threshold, as AverageThresholdKernel
+    AverageThreshold = 2,
+    // any other split, through its kernel
+    Kernel = 3,
+};
+
+class FlatNode {
+public:
+    FlatSplitKind kind;
+    // SingleThreshold: the feature; AverageThreshold: start of the features
+    // in FlatTree::attributes; Kernel: index into FlatTree::kernels
+    int32_t attribute;
+    // AverageThreshold: number of features
+    int32_t numAttributes;
+    // AverageThreshold: scaled as in AverageThresholdKernel
+    float threshold;
+    // the child of branch b is nodes[children[firstChild + b]] for
+    // b < numBranches, or none if children[firstChild + b] is -1
+    int32_t firstChild;
+    int32_t numBranches;
+    // leaves' labels; -1 for internal nodes, which rows stop at if they take
+    // a branch the tree never saw
+    int32_t label;
+};
+
+class FlatTree {
+public:
+    FlatTree() = default;
+
+    explicit FlatTree(const std::shared_ptr<CoordinatorNode>& root)
+    {
+        std::queue<std::shared_ptr<CoordinatorNode>> BFS;
+        BFS.push(root);
+        // nodes are numbered in the order they are queued
+        int numQueued = 1;
+        while (!BFS.empty()) {
+            std::shared_ptr<CoordinatorNode> node = BFS.front();
+            BFS.pop();
+            FlatNode flat{FlatSplitKind::Leaf, 0, 0, 0.0, (int32_t)children.size(), 0, node->label};
+            if (!node->isLeaf) {
+                compileSplit(node, flat);
+                for (int branch = 0; branch < flat.numBranches; branch++) {
+                    auto it = node->children.find(branch);
+                    if (it == node->children.end()) {
+                        children.push_back(-1);
+                        continue;
+                    }
+                    children.push_back(numQueued++);
+                    BFS.push(it->second);
+                }
+            }
+            nodes.push_back(flat);
+        }
+    }
+
+    /*
+     * Label of row of data, as walking the CoordinatorNode tree would give.
+     */
+    int predict(const Dataset& data, size_t row) const
+    {
+        const float* values = data.row(row);
+        const FlatNode* node = &nodes[0];
+        while (node->kind != FlatSplitKind::Leaf) {
+            int branch;
+            switch (node->kind) {
+            case FlatSplitKind::SingleThreshold:
+                branch = values[node->attribute] <= node->threshold;
+                break;
+            case FlatSplitKind::AverageThreshold: {
+                const int* attrs = attributes.data() + node->attribute;
+                float sum = 0.0;
+                for (int i = 0; i < node->numAttributes; i++) {
+                    sum += values[attrs[i]];
+                }
+                branch = sum <= node->threshold;
+                break;
+            }
+            default:
+                branch = applySplitKernel(kernels[node->attribute], data, row);
+                break;
+            }
+            int child = branch >= 0 && branch < node->numBranches
+                            ? children[node->firstChild + branch]
+                            : -1;
+            if (child < 0) {
+                break;
+            }
+            node = &nodes[child];
+        }
+        return node->label;
+    }
+
+    /*
+     * predict for rows[0..n) of data into out, in blocks of
+     * PREDICT_BLOCK_SIZE rows on pool if given.
+     */
+    void predictBatch(const Dataset& data,
+                      const int* rows,
+                      size_t n,
+                      int* out,
+                      ThreadPool* pool = nullptr) const
+    {
+        size_t numBlocks = (n + PREDICT_BLOCK_SIZE - 1) / PREDICT_BLOCK_SIZE;
+        auto predictBlock = [&](size_t b) {
+            size_t end = std::min(n, (b + 1) * PREDICT_BLOCK_SIZE);
+            for (size_t i = b * PREDICT_BLOCK_SIZE; i < end; i++) {
+                out[i] = predict(data, rows[i]);
+            }
+        };
+        if (pool != nullptr) {
+            pool->parallelFor(numBlocks, predictBlock);
+        }
+        else {
+            for (size_t b = 0; b < numBlocks; b++) {
+                predictBlock(b);
+            }
+        }
+    }
+
+    /*
+     * Adds splitFn as a kernel and returns its index, for Kernel nodes.
+     */
+    int32_t addKernel(const std::shared_ptr<Split>& splitFn)
+    {
+        splits.push_back(splitFn);
+        kernels.push_back(makeSplitKernel(splitFn));
+        return (int32_t)kernels.size() - 1;
+    }
+
+    /*
+     * The number of columns rows need for the tree, one past the largest
+     * feature it reads. Custom splits are assumed to read none.
+     */
+    size_t numCols() const
+    {
+        int32_t maxAttribute = -1;
+        for (const FlatNode& node : nodes) {
+            if (node.kind == FlatSplitKind::SingleThreshold) {
+                maxAttribute = std::max(maxAttribute, node.attribute);
+            }
+        }
+        for (int32_t attribute : attributes) {
+            maxAttribute = std::max(maxAttribute, attribute);
+        }
+        for (const std::shared_ptr<Split>& split : splits) {
+            if (const ObliqueSplit* oblique = dynamic_cast<const ObliqueSplit*>(split.get())) {
+                for (int32_t attribute : oblique->xs) {
+                    maxAttribute = std::max(maxAttribute, attribute);
+                }
+                for (int32_t attribute : oblique->ys) {
+                    maxAttribute = std::max(maxAttribute, attribute);
+                }
+            }
+        }
+        return (size_t)(maxAttribute + 1);
+    }
+
+    std::vector<FlatNode> nodes;
+    std::vector<int32_t> children;
+    // features of AverageThreshold nodes
+    std::vector<int32_t> attributes;
+    // splits of Kernel nodes, kept alive for their kernels
+    std::vector<std::shared_ptr<Split>> splits;
+    std::vector<SplitKernel> kernels;
+
+private:
+    void compileSplit(const std::shared_ptr<CoordinatorNode>& node, FlatNode& flat)
+    {
+        for (int label : node->splitFn->labels) {
+            flat.numBranches = std::max(flat.numBranches, label + 1);
+        }
+        SplitKernel kernel = makeSplitKernel(node->splitFn);
+        if (const SingleThresholdKernel* k = std::get_if<SingleThresholdKernel>(&kernel)) {
+            flat.kind = FlatSplitKind::SingleThreshold;
+            flat.attribute = k->attribute;
+            flat.threshold = k->threshold;
+        }
+        else if (const AverageThresholdKernel* k = std::get_if<AverageThresholdKernel>(&kernel)) {
+            flat.kind = FlatSplitKind::AverageThreshold;
+            flat.attribute = (int32_t)attributes.size();
+            flat.numAttributes = (int32_t)k->attributes.size();
+            flat.threshold = k->scaledThreshold;
+            attributes.insert(attributes.end(), k->attributes.begin(), k->attributes.end());
+        }
+        else {
+            flat.kind = FlatSplitKind::Kernel;
+            flat.attribute = addKernel(node->splitFn);
+        }
+    }
+};
+
+#endif // D3T_FLAT_TREE_H
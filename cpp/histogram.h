@@ -0,0 +1,161 @@
+/** @file histogram.h
+ *  @brief Groups the threshold splits of a splitting class by attribute set.
+ *         A node is counted for a whole group with one histogram of the
+ *         attribute sum per label, and the counts of every threshold in the
+ *         group follow from prefix sums, so the cost no longer grows with
+ *         the number of thresholds.
+ */
+
+#ifndef D3T_HISTOGRAM_H
+#define D3T_HISTOGRAM_H
+
+#include "counts.h"
+#include "dataset.h"
+#include "split.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+// groups with at most this many thresholds find a row's bin by a linear count
+constexpr size_t LINEAR_BIN_SEARCH_MAX = 16;
+
+/*
+ * ThresholdSplits of a splitting class on the same attributes. A row falls
+ * in bin b, the index of the first (sorted) threshold its attribute sum is
+ * <= to, or in bin scaledThresholds.size() if there is none. The split with
+ * threshold rank k then sends the rows of bins <= k to branch 1.
+ */
+class ThresholdGroup {
+public:
+    int numBins() const
+    {
+        return (int)scaledThresholds.size() + 1;
+    }
+
+    int bin(float sum) const
+    {
+        if (scaledThresholds.size() <= LINEAR_BIN_SEARCH_MAX) {
+            // also right for NaN, which is <= no threshold
+            int result = 0;
+            for (float t : scaledThresholds) {
+                result += !(sum <= t);
+            }
+            return result;
+        }
+        return (int)(std::partition_point(scaledThresholds.begin(), scaledThresholds.end(),
+                                          [sum](float t) { return !(sum <= t); }) -
+                     scaledThresholds.begin());
+    }
+
+    /*
+     * Adds rows[0..n), whose labels are labels[0..n), to hist, a
+     * [bin][label] histogram.
+     */
+    void accumulate(const Dataset& data,
+                    const int* rows,
+                    const int* labels,
+                    size_t n,
+                    int numLabels,
+                    int* hist) const
+    {
+        std::vector<const float*> columns;
+        for (int attr : attributes) {
+            columns.push_back(data.column(attr));
+        }
+        for (size_t j = 0; j < n; j++) {
+            // same summation order as ThresholdSplit::applySplit
+            float sum = 0.0;
+            for (const float* column : columns) {
+                sum += column[rows[j]];
+            }
+            hist[bin(sum) * numLabels + labels[j]]++;
+        }
+    }
+
+    /*
+     * Writes the [branch][label] counts of every split in the group into
+     * tensor, whose split indices are those of the splitting class.
+     */
+    void fillTensor(const int* hist, int numLabels, CountTensor& tensor) const
+    {
+        // prefix[k][label] = rows in bins <= k
+        std::vector<int> prefix((size_t)numBins() * numLabels);
+        std::vector<int> total(numLabels, 0);
+        for (int b = 0; b < numBins(); b++) {
+            for (int label = 0; label < numLabels; label++) {
+                total[label] += hist[b * numLabels + label];
+                prefix[b * numLabels + label] = total[label];
+            }
+        }
+        for (size_t i = 0; i < splitIdxs.size(); i++) {
+            for (int label = 0; label < numLabels; label++) {
+                int below = prefix[thresholdRanks[i] * numLabels + label];
+                tensor.at(splitIdxs[i], 1, label) = below;
+                tensor.at(splitIdxs[i], 0, label) = total[label] - below;
+            }
+        }
+    }
+
+    std::vector<int> attributes;
+    // sorted, distinct values of threshold * attributes.size()
+    std::vector<float> scaledThresholds;
+    // for each split of the group, its index in the splitting class and the
+    // rank of its threshold in scaledThresholds
+    std::vector<int> splitIdxs;
+    std::vector<int> thresholdRanks;
+};
+
+class SplitGroups {
+public:
+    SplitGroups() = default;
+
+    explicit SplitGroups(const std::vector<std::shared_ptr<Split>>& splittingClass)
+    {
+        std::map<std::vector<int>, size_t> attributes2group;
+        for (size_t i = 0; i < splittingClass.size(); i++) {
+            // exact type check, subclasses may override applySplit
+            if (typeid(*splittingClass[i]) != typeid(ThresholdSplit)) {
+                ungrouped.push_back((int)i);
+                continue;
+            }
+            const ThresholdSplit& split = static_cast<const ThresholdSplit&>(*splittingClass[i]);
+            auto it = attributes2group.find(split.attributes);
+            if (it == attributes2group.end()) {
+                it = attributes2group.insert({split.attributes, groups.size()}).first;
+                groups.emplace_back();
+                groups.back().attributes = split.attributes;
+            }
+            groups[it->second].splitIdxs.push_back((int)i);
+        }
+
+        for (ThresholdGroup& group : groups) {
+            std::vector<float> splitThresholds;
+            for (int splitIdx : group.splitIdxs) {
+                const ThresholdSplit& split =
+                    static_cast<const ThresholdSplit&>(*splittingClass[splitIdx]);
+                splitThresholds.push_back(split.threshold * split.attributes.size());
+            }
+            group.scaledThresholds = splitThresholds;
+            std::sort(group.scaledThresholds.begin(), group.scaledThresholds.end());
+            group.scaledThresholds.erase(
+                std::unique(group.scaledThresholds.begin(), group.scaledThresholds.end()),
+                group.scaledThresholds.end());
+            for (float t : splitThresholds) {
+                group.thresholdRanks.push_back(
+                    (int)(std::lower_bound(group.scaledThresholds.begin(),
+                                           group.scaledThresholds.end(), t) -
+                          group.scaledThresholds.begin()));
+            }
+        }
+        INFO_PRINTF("Grouped %zu splits into %zu threshold groups and %zu other splits\n",
+                    splittingClass.size(), groups.size(), ungrouped.size());
+    }
+
+    std::vector<ThresholdGroup> groups;
+    // indices of the splits that are counted one by one
+    std::vector<int> ungrouped;
+};
+
+#endif // D3T_HISTOGRAM_H
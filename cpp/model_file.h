@@ -0,0 +1,333 @@
+/** @file model_file.h
+ *  @brief Saving trained trees. A model file holds a FlatTree: a header,
+ *         then its nodes, child table, features of average-threshold
+ *         splits and oblique split parameters, in that order. Values are
+ *         in the byte order of the host that wrote the file. A tree of
+ *         threshold splits can also be written out as C++ source that
+ *         scores a row without branching on its values.
+ */
+
+#ifndef D3T_MODEL_FILE_H
+#define D3T_MODEL_FILE_H
+
+#include "flat_tree.h"
+#include "split.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <typeinfo>
+#include <unistd.h>
+#include <vector>
+
+constexpr char MODEL_FILE_MAGIC[8] = {'D', '3', 'T', 'M', 'O', 'D', 'L', '\0'};
+// bumped whenever the layout of the file changes
+constexpr uint32_t MODEL_FILE_VERSION = 1;
+const std::string MODEL_FILE_SUFFIX = ".d3tm";
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    // one past the largest feature the tree reads, see FlatTree::numCols
+    uint32_t numCols;
+    uint32_t numNodes;
+    uint32_t numChildren;
+    uint32_t numAttributes;
+    uint32_t numObliques;
+};
+
+// a FlatNode; Kernel nodes index the ModelFileObliques
+struct ModelFileNode {
+    int32_t kind;
+    int32_t attribute;
+    int32_t numAttributes;
+    float threshold;
+    int32_t firstChild;
+    int32_t numBranches;
+    int32_t label;
+};
+
+// an ObliqueSplit, whose xs and ys are in the features section
+struct ModelFileOblique {
+    int32_t xsBegin;
+    int32_t numXs;
+    int32_t ysBegin;
+    int32_t numYs;
+    float m;
+    float b;
+};
+
+/*
+ * Writes tree to path, returns true if successful. Trees with splits other
+ * than ThresholdSplit and ObliqueSplit cannot be saved.
+ */
+bool writeModelFile(const FlatTree& tree, const std::string& path)
+{
+    std::vector<int32_t> attributes = tree.attributes;
+    std::vector<ModelFileOblique> obliques;
+    for (const std::shared_ptr<Split>& split : tree.splits) {
+        if (typeid(*split) != typeid(ObliqueSplit)) {
+            std::cerr << "cannot save " << typeid(*split).name() << " to " << path << std::endl;
+            return false;
+        }
+        const ObliqueSplit& oblique = static_cast<const ObliqueSplit&>(*split);
+        ModelFileOblique record{(int32_t)attributes.size(), (int32_t)oblique.xs.size(), 0,
+                                (int32_t)oblique.ys.size(), oblique.m, oblique.b};
+        attributes.insert(attributes.end(), oblique.xs.begin(), oblique.xs.end());
+        record.ysBegin = (int32_t)attributes.size();
+        attributes.insert(attributes.end(), oblique.ys.begin(), oblique.ys.end());
+        obliques.push_back(record);
+    }
+    std::vector<ModelFileNode> nodes;
+    for (const FlatNode& node : tree.nodes) {
+        nodes.push_back(ModelFileNode{(int32_t)node.kind, node.attribute, node.numAttributes,
+                                      node.threshold, node.firstChild, node.numBranches,
+                                      node.label});
+    }
+
+    ModelFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.numCols = (uint32_t)tree.numCols();
+    header.numNodes = (uint32_t)nodes.size();
+    header.numChildren = (uint32_t)tree.children.size();
+    header.numAttributes = (uint32_t)attributes.size();
+    header.numObliques = (uint32_t)obliques.size();
+
+    std::ofstream output(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    auto write = [&](const void* bytes, size_t size) {
+        output.write(static_cast<const char*>(bytes), size);
+    };
+    write(&header, sizeof(header));
+    write(nodes.data(), nodes.size() * sizeof(ModelFileNode));
+    write(tree.children.data(), tree.children.size() * sizeof(int32_t));
+    write(attributes.data(), attributes.size() * sizeof(int32_t));
+    write(obliques.data(), obliques.size() * sizeof(ModelFileOblique));
+    if (!output) {
+        std::cerr << "failed to write model to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Maps the model file at path and rebuilds its tree into tree, returns true
+ * if successful.
+ */
+bool loadModelFile(FlatTree& tree, const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << path << " not found!" << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ModelFileHeader)) {
+        std::cerr << path << " is not a model file" << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    void* base = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "failed to map " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::shared_ptr<char> mapping(static_cast<char*>(base),
+                                  [fileSize](char* p) { munmap(p, fileSize); });
+
+    ModelFileHeader header;
+    std::memcpy(&header, mapping.get(), sizeof(header));
+    if (std::memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MODEL_FILE_VERSION) {
+        std::cerr << path << " is not a version " << MODEL_FILE_VERSION << " model file"
+                  << std::endl;
+        return false;
+    }
+    uint64_t expectedSize = sizeof(header) + (uint64_t)header.numNodes * sizeof(ModelFileNode) +
+                            (uint64_t)header.numChildren * sizeof(int32_t) +
+                            (uint64_t)header.numAttributes * sizeof(int32_t) +
+                            (uint64_t)header.numObliques * sizeof(ModelFileOblique);
+    if (header.numNodes == 0 || fileSize != expectedSize) {
+        std::cerr << path << " is truncated or corrupt" << std::endl;
+        return false;
+    }
+    const char* section = mapping.get() + sizeof(header);
+    std::vector<ModelFileNode> nodes(header.numNodes);
+    std::memcpy(nodes.data(), section, nodes.size() * sizeof(ModelFileNode));
+    section += nodes.size() * sizeof(ModelFileNode);
+    std::vector<int32_t> children(header.numChildren);
+    std::memcpy(children.data(), section, children.size() * sizeof(int32_t));
+    section += children.size() * sizeof(int32_t);
+    std::vector<int32_t> attributes(header.numAttributes);
+    std::memcpy(attributes.data(), section, attributes.size() * sizeof(int32_t));
+    section += attributes.size() * sizeof(int32_t);
+    std::vector<ModelFileOblique> obliques(header.numObliques);
+    std::memcpy(obliques.data(), section, obliques.size() * sizeof(ModelFileOblique));
+
+    // every index is checked, so predict stays in bounds
+    auto inRange = [](int64_t begin, int64_t size, size_t total) {
+        return begin >= 0 && size >= 0 && (uint64_t)(begin + size) <= total;
+    };
+    FlatTree result;
+    for (const ModelFileOblique& oblique : obliques) {
+        if (!inRange(oblique.xsBegin, oblique.numXs, attributes.size()) ||
+            !inRange(oblique.ysBegin, oblique.numYs, attributes.size())) {
+            std::cerr << path << " is truncated or corrupt" << std::endl;
+            return false;
+        }
+        std::vector<int> xs(attributes.begin() + oblique.xsBegin,
+                            attributes.begin() + oblique.xsBegin + oblique.numXs);
+        std::vector<int> ys(attributes.begin() + oblique.ysBegin,
+                            attributes.begin() + oblique.ysBegin + oblique.numYs);
+        result.addKernel(std::make_shared<ObliqueSplit>(xs, ys, oblique.m, oblique.b));
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const ModelFileNode& node = nodes[i];
+        bool valid = inRange(node.firstChild, node.numBranches, children.size());
+        // children come after their parents in BFS order, so walks end
+        for (int32_t b = 0; valid && b < node.numBranches; b++) {
+            int32_t child = children[node.firstChild + b];
+            valid = child == -1 || (child > (int32_t)i && child < (int32_t)nodes.size());
+        }
+        switch ((FlatSplitKind)node.kind) {
+        case FlatSplitKind::Leaf:
+            break;
+        case FlatSplitKind::SingleThreshold:
+            valid = valid && node.attribute >= 0;
+            break;
+        case FlatSplitKind::AverageThreshold:
+            valid = valid && inRange(node.attribute, node.numAttributes, attributes.size());
+            break;
+        case FlatSplitKind::Kernel:
+            valid = valid && inRange(node.attribute, 1, result.kernels.size());
+            break;
+        default:
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << path << " is truncated or corrupt" << std::endl;
+            return false;
+        }
+        result.nodes.push_back(FlatNode{(FlatSplitKind)node.kind, node.attribute,
+                                        node.numAttributes, node.threshold, node.firstChild,
+                                        node.numBranches, node.label});
+    }
+    result.children = std::move(children);
+    result.attributes = std::move(attributes);
+    tree = std::move(result);
+    return true;
+}
+
+/*
+ * Writes C++ source defining int functionName(const float* row), which
+ * returns the label tree gives a row of at least tree.numCols() features.
+ * Every row takes as many steps as the tree is deep, and each step picks
+ * the next node by indexing with the comparison, so scoring has no branches
+ * on feature values; leaves and missing branches lead back to their node.
+ * Only trees of threshold splits are supported, returns true if successful.
+ */
+bool writeModelSource(const FlatTree& tree,
+                      const std::string& path,
+                      const std::string& functionName)
+{
+    if (!tree.kernels.empty()) {
+        std::cerr << "cannot write source for a tree with non-threshold splits to " << path
+                  << std::endl;
+        return false;
+    }
+    // the features of every split, single thresholds included
+    std::vector<int32_t> attributes;
+    std::vector<int32_t> depths(tree.nodes.size(), 0);
+    int32_t maxDepth = 0;
+    std::string nodesSource, labelsSource;
+    char buf[200];
+    for (size_t i = 0; i < tree.nodes.size(); i++) {
+        const FlatNode& node = tree.nodes[i];
+        int32_t begin = (int32_t)attributes.size();
+        int32_t numAttributes = 0;
+        int32_t next[2] = {(int32_t)i, (int32_t)i};
+        if (node.kind == FlatSplitKind::SingleThreshold) {
+            attributes.push_back(node.attribute);
+            numAttributes = 1;
+        }
+        else if (node.kind == FlatSplitKind::AverageThreshold) {
+            attributes.insert(attributes.end(), tree.attributes.begin() + node.attribute,
+                              tree.attributes.begin() + node.attribute + node.numAttributes);
+            numAttributes = node.numAttributes;
+        }
+        if (node.kind != FlatSplitKind::Leaf) {
+            for (int32_t branch = 0; branch < 2 && branch < node.numBranches; branch++) {
+                int32_t child = tree.children[node.firstChild + branch];
+                if (child >= 0) {
+                    next[branch] = child;
+                    // children come after their parents in BFS order
+                    depths[child] = depths[i] + 1;
+                    maxDepth = std::max(maxDepth, depths[child]);
+                }
+            }
+        }
+        snprintf(buf, sizeof(buf), "    {%d, %d, %.9ef, {%d, %d}},\n", begin, numAttributes,
+                 numAttributes > 0 ? node.threshold : 0.0f, next[0], next[1]);
+        nodesSource += buf;
+        labelsSource += "    " + std::to_string(node.label) + ",\n";
+    }
+    if (attributes.empty()) {
+        // arrays cannot be empty
+        attributes.push_back(0);
+    }
+    std::string attributesSource;
+    for (size_t i = 0; i < attributes.size(); i++) {
+        attributesSource += (i % 16 == 0 ? "    " : " ") + std::to_string(attributes[i]) + ",";
+        if (i % 16 == 15 || i + 1 == attributes.size()) {
+            attributesSource += "\n";
+        }
+    }
+
+    std::ofstream output(path, std::ios::out | std::ios::trunc);
+    output << "// Generated from a d3t decision tree of " << tree.nodes.size() << " nodes.\n"
+           << "// " << functionName << "(row) is the label of a row of at least "
+           << tree.numCols() << " features.\n\n"
+           << "#include <cstdint>\n\n"
+           << "namespace {\n\n"
+           << "struct Node {\n"
+           << "    int32_t attributesBegin;\n"
+           << "    int32_t numAttributes;\n"
+           << "    float threshold;\n"
+           << "    int32_t next[2];\n"
+           << "};\n\n"
+           << "const int32_t kAttributes[] = {\n" << attributesSource << "};\n\n"
+           << "const Node kNodes[] = {\n" << nodesSource << "};\n\n"
+           << "const int32_t kLabels[] = {\n" << labelsSource << "};\n\n"
+           << "} // namespace\n\n"
+           << "int " << functionName << "(const float* row)\n"
+           << "{\n"
+           << "    int32_t node = 0;\n"
+           << "    for (int depth = 0; depth < " << maxDepth << "; depth++) {\n"
+           << "        const Node& n = kNodes[node];\n"
+           << "        float sum = 0.0f;\n"
+           << "        for (int32_t i = 0; i < n.numAttributes; i++) {\n"
+           << "            sum += row[kAttributes[n.attributesBegin + i]];\n"
+           << "        }\n"
+           << "        node = n.next[sum <= n.threshold];\n"
+           << "    }\n"
+           << "    return kLabels[node];\n"
+           << "}\n";
+    if (!output) {
+        std::cerr << "failed to write model source to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif // D3T_MODEL_FILE_H
@@ -5,17 +5,106 @@
 #ifndef D3T_PRIVACYNOISE_H
 #define D3T_PRIVACYNOISE_H
 #include "utils.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <random>
 
+/*
+ * What a noised query releases, part of the identity its counter-based
+ * noise is keyed by, see Noise::laplaceBatch.
+ */
+enum class NoiseQuery : uint32_t {
+    TotalCount = 1,
+    LabelCounts = 2,
+    SplitCounts = 3,
+    SplitLabelCounts = 4,
+    LocalRNM = 5,
+};
+
+// the splitmix64 finalizer
+inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Noise key of the node reached from the node keyed parent through branch
+ * of split, an index into the splitting class. The root's key is 0, so a
+ * node's key depends on its path from the root only, not on the order
+ * nodes were split in.
+ */
+inline uint64_t childNoiseKey(uint64_t parent, uint32_t split, uint32_t branch)
+{
+    return mix64(parent ^ mix64(((uint64_t)split << 32 | branch) + 0x9E3779B97F4A7C15));
+}
+
+/*
+ * Philox4x32-10 (Salmon et al., Parallel Random Numbers: As Easy as 1, 2,
+ * 3): four random words from a counter and a key, with no state in between.
+ */
+inline void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/*
+ * Laplace noise of scale b from a random word, by inverting the CDF at the
+ * midpoint of one of 2^24 equal intervals of (0, 1), so it is never
+ * infinite. Both halves are computed from exact floats.
+ */
+inline float laplaceFromBits(uint32_t bits, float b)
+{
+    uint32_t u = bits >> 8;
+    bool lower = u < (1u << 23);
+    uint32_t distance = lower ? u : (1u << 24) - 1 - u;
+    // 2 * min(u, 1 - u), in (0, 1)
+    float tail = (float)(2 * distance + 1) * (1.0f / (1 << 24));
+    float magnitude = -b * std::log(tail);
+    return lower ? -magnitude : magnitude;
+}
+
 class Noise {
 public:
-    Noise(int seed, bool turnOffNoise) : rng_(seed), turnOffNoise_(turnOffNoise)
+    /*
+     * Draws come from one sequential stream seeded with seed + entityIdx,
+     * unless counterBased, in which case laplaceBatch keys them by seed,
+     * entityIdx and the query instead.
+     */
+    Noise(int seed, int entityIdx, bool turnOffNoise, bool counterBased = false)
+        : rng_(seed + entityIdx),
+          entityKey_(mix64((uint64_t)(uint32_t)seed << 32 | (uint32_t)entityIdx)),
+          turnOffNoise_(turnOffNoise),
+          counterBased_(counterBased)
     {
         if (turnOffNoise_) {
             std::cout << "Turned off noise!" << std::endl;
         }
+        else if (counterBased_) {
+            std::cout << "Counter-based noise with seed " << seed << " for entity " << entityIdx
+                      << std::endl;
+        }
         else {
-            std::cout << "Noise with seed " << seed << std::endl;
+            std::cout << "Noise with seed " << seed + entityIdx << std::endl;
         }
     }
 
@@ -31,9 +120,51 @@ public:
         }
     }
 
+    /*
+     * Fills out[0..n) with Laplace noise of scale b for cells 0..n-1 of the
+     * query of kind about split (an index into the splitting class, or 0)
+     * at the node keyed node, see childNoiseKey. Each value depends only on
+     * the seed, the entity and this logical identity of the query and cell,
+     * not on when or on which thread it is drawn, so reordering queries
+     * leaves every draw the same. A query repeated with the same scale gets
+     * the same noise and so releases nothing new; one with another scale,
+     * i.e. another budget, gets independent noise.
+     */
+    void laplaceBatch(
+        float b, uint64_t node, NoiseQuery kind, uint32_t split, size_t n, float* out) const
+    {
+        if (turnOffNoise_) {
+            std::fill(out, out + n, 0.0f);
+            return;
+        }
+        uint64_t nodeKey = mix64(entityKey_ ^ node);
+        uint32_t key[2] = {(uint32_t)nodeKey, (uint32_t)(nodeKey >> 32)};
+        uint32_t scaleBits;
+        std::memcpy(&scaleBits, &b, sizeof(b));
+        // each counter gives the bits of four consecutive cells
+        uint32_t counter[4] = {0, (uint32_t)kind, split, scaleBits};
+        uint32_t bits[4];
+        assert(n <= (size_t)4 << 32);
+        for (size_t begin = 0; begin < n; begin += 4) {
+            counter[0] = (uint32_t)(begin / 4);
+            philox4x32(counter, key, bits);
+            for (size_t i = begin; i < n && i < begin + 4; i++) {
+                out[i] = laplaceFromBits(bits[i - begin], b);
+            }
+        }
+    }
+
+    bool counterBased() const
+    {
+        return counterBased_;
+    }
+
 private:
     std::mt19937 rng_;
+    // seed and entity, mixed
+    uint64_t entityKey_;
     bool turnOffNoise_;
+    bool counterBased_;
 };
 
 #endif // D3T_PRIVACYNOISE_H
@@ -0,0 +1,95 @@
+/** @file predict.cpp
+ *  @brief Scores a dataset with a saved model (see model_file.h), in
+ *         blocks of rows across threads, and writes the label of each row
+ *         in file order, one per line. The dataset is a protobuf file or a
+ *         dataset file (see dataset_file.h); a dataset file next to the
+ *         protobuf file is mapped instead of parsing it. With a source path,
+ *         the model is written out as C++ instead.
+ *
+ *         usage: predict <model> <dataset> [<output> [<num threads>]]
+ *                predict <model> --source <output> [<function name>]
+ */
+
+#include "dataset_file.h"
+#include "model_file.h"
+
+#include <chrono>
+
+int main(int argc, char* argv[])
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    if (argc < 3) {
+        printf("usage: %s <model> <dataset> [<output> [<num threads>]]\n", argv[0]);
+        printf("       %s <model> --source <output> [<function name>]\n", argv[0]);
+        return 1;
+    }
+    FlatTree tree;
+    if (!loadModelFile(tree, argv[1])) {
+        return 1;
+    }
+    if (std::string(argv[2]) == "--source") {
+        if (argc < 4) {
+            printf("--source needs an output path\n");
+            return 1;
+        }
+        std::string functionName = argc > 4 ? std::string(argv[4]) : "predict";
+        return writeModelSource(tree, argv[3], functionName) ? 0 : 1;
+    }
+    std::string input(argv[2]);
+    std::string output = argc > 3 ? std::string(argv[3]) : "";
+    int numThreads = argc > 4 ? std::stoi(std::string(argv[4])) : 0;
+
+    // every row in file order
+    Dataset data;
+    size_t numLabels;
+    bool isDatasetFile = input.size() >= DATASET_FILE_SUFFIX.size() &&
+                         input.compare(input.size() - DATASET_FILE_SUFFIX.size(),
+                                       DATASET_FILE_SUFFIX.size(), DATASET_FILE_SUFFIX) == 0;
+    if (isDatasetFile) {
+        numLabels = mapDatasetFile(data, input);
+    }
+    else if (access((input + DATASET_FILE_SUFFIX).c_str(), R_OK) == 0) {
+        numLabels = mapDatasetFile(data, input + DATASET_FILE_SUFFIX);
+    }
+    else {
+        numLabels = parseProtobuf(data, input, 0, 1.0, false);
+    }
+    if (numLabels == 0) {
+        return 1;
+    }
+    if (data.numCols < tree.numCols()) {
+        printf("the model reads %zu features but %s has %zu\n", tree.numCols(), input.c_str(),
+               data.numCols);
+        return 1;
+    }
+
+    std::vector<int> rows(data.numRows);
+    for (size_t r = 0; r < data.numRows; r++) {
+        rows[r] = (int)r;
+    }
+    std::vector<int> predictions(data.numRows);
+    ThreadPool pool(numThreads);
+    auto start = std::chrono::high_resolution_clock::now();
+    tree.predictBatch(data, rows.data(), rows.size(), predictions.data(), &pool);
+    auto end = std::chrono::high_resolution_clock::now();
+    size_t numCorrect = 0;
+    for (size_t r = 0; r < data.numRows; r++) {
+        numCorrect += predictions[r] == data.label(r);
+    }
+    printf("Scored %zu rows on %d threads in %.3f ms, accuracy %f\n", data.numRows,
+           pool.numThreads(),
+           std::chrono::duration<double, std::milli>(end - start).count(),
+           data.numRows > 0 ? (double)numCorrect / data.numRows : 0.0);
+
+    if (!output.empty()) {
+        std::ofstream out(output, std::ios::out | std::ios::trunc);
+        for (int prediction : predictions) {
+            out << prediction << "\n";
+        }
+        if (!out) {
+            std::cerr << "failed to write predictions to " << output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,498 @@
+/** @file remote_entity.h
+ *  @brief Entity queries over the RPC transport of rpc.h. RemoteEntity is the
+ *         coordinator's proxy for an entity in another process, which answers
+ *         with serveEntity: either a forked child (see forkEntities) or a
+ *         connection to an entity_server that loads its own partition.
+ */
+
+#ifndef D3T_REMOTE_ENTITY_H
+#define D3T_REMOTE_ENTITY_H
+
+#include "entity.h"
+#include "rpc.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <sys/wait.h>
+#include <unordered_map>
+#include <vector>
+
+// bumped whenever a request or reply changes layout
+constexpr uint32_t ENTITY_PROTOCOL_VERSION = 5;
+
+enum class EntityMethod : uint32_t {
+    Init = 1,
+    SplitLeaf = 2,
+    PrefetchChildren = 3,
+    NodeStatistics = 4,
+    LabelCounts = 5,
+    TotalCount = 6,
+    LocalRNM = 7,
+    CountLeaves = 8,
+    SplitLeaves = 9,
+};
+
+/*
+ * Everything an entity_server needs to build the entity performTest would
+ * have built in process: it parses the training set the same way and keeps
+ * rows [rowBegin, rowEnd) of it.
+ */
+class EntityServerConfig {
+public:
+    void write(WireWriter& out) const
+    {
+        out.put(ENTITY_PROTOCOL_VERSION);
+        out.putString(dataset);
+        out.put((int32_t)seed);
+        out.put(trainingFraction);
+        out.putString(splittingCriterionName);
+        out.put((int32_t)entityIdx);
+        out.put((uint8_t)turnOffNoise);
+        out.put((int32_t)rowBegin);
+        out.put((int32_t)rowEnd);
+        out.put((uint8_t)options.splitBitmaps);
+        out.put((uint64_t)options.tensorCacheBytes);
+        out.put((uint64_t)options.parallelScanRows);
+        out.put((uint8_t)options.streamRows);
+        out.put((uint64_t)options.streamChunkRows);
+        out.put((uint64_t)options.streamReadAhead);
+        out.put((uint8_t)options.counterNoise);
+        out.put((uint8_t)options.binnedFeatures);
+    }
+
+    // false if the client speaks another protocol version
+    bool read(WireReader& in)
+    {
+        if (in.get<uint32_t>() != ENTITY_PROTOCOL_VERSION) {
+            return false;
+        }
+        dataset = in.getString();
+        seed = in.get<int32_t>();
+        trainingFraction = in.get<float>();
+        splittingCriterionName = in.getString();
+        entityIdx = in.get<int32_t>();
+        turnOffNoise = in.get<uint8_t>() != 0;
+        rowBegin = in.get<int32_t>();
+        rowEnd = in.get<int32_t>();
+        options.splitBitmaps = in.get<uint8_t>() != 0;
+        options.tensorCacheBytes = in.get<uint64_t>();
+        options.parallelScanRows = in.get<uint64_t>();
+        options.streamRows = in.get<uint8_t>() != 0;
+        options.streamChunkRows = in.get<uint64_t>();
+        options.streamReadAhead = in.get<uint64_t>();
+        options.counterNoise = in.get<uint8_t>() != 0;
+        options.binnedFeatures = in.get<uint8_t>() != 0;
+        return true;
+    }
+
+    std::string dataset;
+    int seed = 0;
+    float trainingFraction = 1.0;
+    std::string splittingCriterionName;
+    int entityIdx = 0;
+    bool turnOffNoise = false;
+    int rowBegin = 0;
+    int rowEnd = 0;
+    EntityOptions options;
+};
+
+/*
+ * Answers the requests on fd with entity until the client hangs up. Splits
+ * travel as indices into splittingClass, which is built the same way on
+ * both ends. Requests are handled one at a time in the order they arrive,
+ * so a request without reply (e.g. SplitLeaf) is done before the next one.
+ * Every request is read and checked against the entity before it is
+ * handled, and a malformed one drops the connection.
+ */
+void serveEntity(int fd, Entity& entity, const std::vector<std::shared_ptr<Split>>& splittingClass)
+{
+    auto validSplits = [&](const std::vector<int32_t>& idxs) {
+        return std::all_of(idxs.begin(), idxs.end(), [&](int32_t idx) {
+            return idx >= 0 && idx < (int32_t)splittingClass.size();
+        });
+    };
+    auto validLeaves = [&](const std::vector<int32_t>& ids) {
+        return std::all_of(ids.begin(), ids.end(), [&](int32_t id) { return entity.hasLeaf(id); });
+    };
+    auto splits = [&](const std::vector<int32_t>& idxs) {
+        std::vector<std::shared_ptr<Split>> result;
+        for (int32_t idx : idxs) {
+            result.push_back(splittingClass[idx]);
+        }
+        return result;
+    };
+
+    RpcHeader header;
+    std::vector<char> payload;
+    while (readFrame(fd, header, payload)) {
+        WireReader request(payload);
+        WireWriter reply;
+        int id = request.get<int32_t>();
+        bool valid = true;
+        switch ((EntityMethod)header.method) {
+        case EntityMethod::SplitLeaf: {
+            int32_t idx = request.get<int32_t>();
+            valid = request.done() && entity.hasLeaf(id) && validSplits({idx});
+            if (valid) {
+                entity.splitLeafWithFn(id, splittingClass[idx]);
+            }
+            break;
+        }
+        case EntityMethod::SplitLeaves: {
+            std::vector<int32_t> ids = request.getVector<int32_t>();
+            std::vector<int32_t> idxs = request.getVector<int32_t>();
+            // a leaf split twice would be partitioned twice
+            std::vector<int32_t> sortedIds = ids;
+            std::sort(sortedIds.begin(), sortedIds.end());
+            valid = request.done() && ids.size() == idxs.size() && validLeaves(ids) &&
+                    validSplits(idxs) &&
+                    std::adjacent_find(sortedIds.begin(), sortedIds.end()) == sortedIds.end();
+            if (valid) {
+                entity.splitLeaves(std::vector<int>(ids.begin(), ids.end()), splits(idxs));
+            }
+            break;
+        }
+        case EntityMethod::PrefetchChildren:
+            valid = request.done() && entity.hasNode(id);
+            if (valid) {
+                entity.prefetchChildren(id);
+            }
+            break;
+        case EntityMethod::CountLeaves: {
+            std::vector<int32_t> ids = request.getVector<int32_t>();
+            valid = request.done() && validLeaves(ids);
+            if (valid) {
+                entity.countLeaves(std::vector<int>(ids.begin(), ids.end()));
+            }
+            break;
+        }
+        case EntityMethod::NodeStatistics: {
+            std::vector<int32_t> idxs = request.getVector<int32_t>();
+            float splitLabelEps = request.get<float>();
+            float splitEps = request.get<float>();
+            float labelEps = request.get<float>();
+            bool withSplitCounts = request.get<uint8_t>() != 0;
+            valid = request.done() && entity.hasNode(id) && validSplits(idxs);
+            if (!valid) {
+                break;
+            }
+            NodeStatistics statistics = entity.getNodeStatistics(
+                id, splits(idxs), splitLabelEps, splitEps, labelEps, withSplitCounts);
+            reply.put((uint32_t)statistics.splitLabelCounts.size());
+            for (const std::vector<float>& counts : statistics.splitLabelCounts) {
+                reply.putVector(counts);
+            }
+            reply.put((uint32_t)statistics.splitCounts.size());
+            for (const std::vector<float>& counts : statistics.splitCounts) {
+                reply.putVector(counts);
+            }
+            reply.putVector(statistics.labelCounts);
+            break;
+        }
+        case EntityMethod::LabelCounts: {
+            float privacyEps = request.get<float>();
+            valid = request.done() && entity.hasNode(id);
+            if (valid) {
+                reply.putVector(entity.getLabelCounts(id, privacyEps));
+            }
+            break;
+        }
+        case EntityMethod::TotalCount: {
+            float privacyEps = request.get<float>();
+            valid = request.done() && entity.hasNode(id);
+            if (valid) {
+                reply.put(entity.getTotalCount(id, privacyEps));
+            }
+            break;
+        }
+        case EntityMethod::LocalRNM: {
+            float privacyEps = request.get<float>();
+            valid = request.done() && entity.hasNode(id);
+            if (!valid) {
+                break;
+            }
+            std::shared_ptr<Split> bestSplit;
+            float infoGain;
+            std::tie(bestSplit, infoGain) = entity.localRNM(id, privacyEps);
+            int32_t idx = -1;
+            for (size_t i = 0; i < splittingClass.size() && bestSplit != nullptr; i++) {
+                if (splittingClass[i] == bestSplit) {
+                    idx = (int32_t)i;
+                    break;
+                }
+            }
+            reply.put(idx);
+            reply.put(infoGain);
+            break;
+        }
+        default:
+            WARNING_PRINTF("Unknown entity method %u, dropping the connection\n", header.method);
+            return;
+        }
+        if (!valid) {
+            WARNING_PRINTF("Malformed request for entity method %u, dropping the connection\n",
+                           header.method);
+            return;
+        }
+        if (header.id != 0 && !writeFrame(fd, 0, header.id, reply.buffer)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Proxy for an entity in another process. Queries block until their reply
+ * arrives, so the coordinator overlaps entities by querying them from
+ * several threads; splitting, prefetching and counting leaves are sent
+ * without waiting.
+ */
+class RemoteEntity : public EntityInterface {
+public:
+    /*
+     * Takes ownership of the connected socket fd. pid is the entity's
+     * process if this process forked it, to be reaped on destruction.
+     */
+    RemoteEntity(int fd, std::vector<std::shared_ptr<Split>> splittingClass, pid_t pid = -1)
+        : client_(new RpcClient(fd)), splittingClass_(std::move(splittingClass)), pid_(pid)
+    {
+        for (size_t i = 0; i < splittingClass_.size(); i++) {
+            splitIdx_.insert({splittingClass_[i]->id, (int32_t)i});
+        }
+    }
+
+    RemoteEntity(const RemoteEntity&) = delete;
+    RemoteEntity& operator=(const RemoteEntity&) = delete;
+
+    ~RemoteEntity() override
+    {
+        // closing the connection ends the child's serveEntity
+        client_.reset();
+        if (pid_ > 0) {
+            waitpid(pid_, nullptr, 0);
+        }
+    }
+
+    /*
+     * Has an entity_server build its entity, returns false if it could not.
+     */
+    bool init(const EntityServerConfig& config)
+    {
+        WireWriter request;
+        request.put((int32_t)-1);
+        config.write(request);
+        std::vector<char> payload = call(EntityMethod::Init, request);
+        WireReader reply(payload);
+        return reply.get<uint8_t>() != 0;
+    }
+
+    void splitLeafWithFn(int id, const std::shared_ptr<Split>& splitFn) override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        request.put(splitIndex(splitFn));
+        client_->post((uint32_t)EntityMethod::SplitLeaf, request);
+    }
+
+    void splitLeaves(const std::vector<int>& ids,
+                     const std::vector<std::shared_ptr<Split>>& splitFns) override
+    {
+        WireWriter request;
+        request.put((int32_t)-1);
+        request.putVector(std::vector<int32_t>(ids.begin(), ids.end()));
+        std::vector<int32_t> splitIdxs;
+        for (const std::shared_ptr<Split>& splitFn : splitFns) {
+            splitIdxs.push_back(splitIndex(splitFn));
+        }
+        request.putVector(splitIdxs);
+        client_->post((uint32_t)EntityMethod::SplitLeaves, request);
+    }
+
+    void prefetchChildren(int id) const override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        client_->post((uint32_t)EntityMethod::PrefetchChildren, request);
+    }
+
+    void countLeaves(const std::vector<int>& ids) const override
+    {
+        WireWriter request;
+        request.put((int32_t)-1);
+        request.putVector(std::vector<int32_t>(ids.begin(), ids.end()));
+        client_->post((uint32_t)EntityMethod::CountLeaves, request);
+    }
+
+    NodeStatistics getNodeStatistics(int id,
+                                     const std::vector<std::shared_ptr<Split>>& splits,
+                                     float splitLabelEps,
+                                     float splitEps,
+                                     float labelEps,
+                                     bool withSplitCounts = true) const override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        std::vector<int32_t> splitIdxs;
+        for (const std::shared_ptr<Split>& splitFn : splits) {
+            splitIdxs.push_back(splitIndex(splitFn));
+        }
+        request.putVector(splitIdxs);
+        request.put(splitLabelEps);
+        request.put(splitEps);
+        request.put(labelEps);
+        request.put((uint8_t)withSplitCounts);
+        std::vector<char> payload = call(EntityMethod::NodeStatistics, request);
+
+        WireReader reply(payload);
+        NodeStatistics result;
+        // at most one vector per split, before allocating them
+        uint32_t numSplitLabelCounts = reply.get<uint32_t>();
+        if (numSplitLabelCounts > splits.size()) {
+            throw std::runtime_error("malformed reply from entity");
+        }
+        result.splitLabelCounts.resize(numSplitLabelCounts);
+        for (std::vector<float>& counts : result.splitLabelCounts) {
+            counts = reply.getVector<float>();
+        }
+        uint32_t numSplitCounts = reply.get<uint32_t>();
+        if (numSplitCounts > splits.size()) {
+            throw std::runtime_error("malformed reply from entity");
+        }
+        result.splitCounts.resize(numSplitCounts);
+        for (std::vector<float>& counts : result.splitCounts) {
+            counts = reply.getVector<float>();
+        }
+        result.labelCounts = reply.getVector<float>();
+        checkReply(reply);
+        return result;
+    }
+
+    std::vector<float> getLabelCounts(int id, float privacyEps) const override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        request.put(privacyEps);
+        std::vector<char> payload = call(EntityMethod::LabelCounts, request);
+        WireReader reply(payload);
+        std::vector<float> result = reply.getVector<float>();
+        checkReply(reply);
+        return result;
+    }
+
+    float getTotalCount(int id, float privacyEps) const override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        request.put(privacyEps);
+        std::vector<char> payload = call(EntityMethod::TotalCount, request);
+        WireReader reply(payload);
+        float result = reply.get<float>();
+        checkReply(reply);
+        return result;
+    }
+
+    std::tuple<std::shared_ptr<Split>, float> localRNM(int id, float privacyEps) const override
+    {
+        WireWriter request;
+        request.put((int32_t)id);
+        request.put(privacyEps);
+        std::vector<char> payload = call(EntityMethod::LocalRNM, request);
+        WireReader reply(payload);
+        int32_t idx = reply.get<int32_t>();
+        float infoGain = reply.get<float>();
+        checkReply(reply);
+        if (idx >= (int32_t)splittingClass_.size()) {
+            throw std::runtime_error("entity replied with an unknown split");
+        }
+        return std::make_tuple(idx < 0 ? nullptr : splittingClass_[idx], infoGain);
+    }
+
+private:
+    std::vector<char> call(EntityMethod method, const WireWriter& request) const
+    {
+        return client_->call((uint32_t)method, request).get();
+    }
+
+    // replies are trusted no further than requests, see serveEntity
+    static void checkReply(const WireReader& reply)
+    {
+        if (!reply.done()) {
+            throw std::runtime_error("malformed reply from entity");
+        }
+    }
+
+    int32_t splitIndex(const std::shared_ptr<Split>& splitFn) const
+    {
+        auto it = splitIdx_.find(splitFn->id);
+        assert(it != splitIdx_.end());
+        return it->second;
+    }
+
+    std::unique_ptr<RpcClient> client_;
+    const std::vector<std::shared_ptr<Split>> splittingClass_;
+    // Split::id to index in splittingClass_
+    std::unordered_map<int, int32_t> splitIdx_;
+    pid_t pid_;
+};
+
+/*
+ * Runs makeEntity(i) for i < numEntities each in a child process, which
+ * serves it over a socket pair, and returns proxies to them. All children
+ * are forked before any proxy starts its reader thread, and each closes the
+ * sockets of its elder siblings, so a child exits as soon as its proxy is
+ * destroyed. Returns no proxies if a child cannot be started.
+ */
+std::vector<std::shared_ptr<EntityInterface>> forkEntities(
+    size_t numEntities,
+    const std::function<std::shared_ptr<Entity>(size_t)>& makeEntity,
+    const std::vector<std::shared_ptr<Split>>& splittingClass)
+{
+    std::vector<int> fds;
+    std::vector<pid_t> pids;
+    // closing its socket ends a child's serveEntity
+    auto reapChildren = [&]() {
+        for (size_t i = 0; i < fds.size(); i++) {
+            close(fds[i]);
+            waitpid(pids[i], nullptr, 0);
+        }
+    };
+    for (size_t i = 0; i < numEntities; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            WARNING_PRINTF("socketpair failed: %s\n", strerror(errno));
+            reapChildren();
+            return {};
+        }
+        // buffered output would be printed by both processes
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            WARNING_PRINTF("fork failed: %s\n", strerror(errno));
+            close(pair[0]);
+            close(pair[1]);
+            reapChildren();
+            return {};
+        }
+        if (pid == 0) {
+            for (int fd : fds) {
+                close(fd);
+            }
+            close(pair[0]);
+            std::shared_ptr<Entity> entity = makeEntity(i);
+            serveEntity(pair[1], *entity, splittingClass);
+            fflush(stdout);
+            _exit(0);
+        }
+        close(pair[1]);
+        fds.push_back(pair[0]);
+        pids.push_back(pid);
+    }
+
+    std::vector<std::shared_ptr<EntityInterface>> result;
+    for (size_t i = 0; i < numEntities; i++) {
+        result.push_back(std::make_shared<RemoteEntity>(fds[i], splittingClass, pids[i]));
+    }
+    return result;
+}
+
+#endif // D3T_REMOTE_ENTITY_H
@@ -0,0 +1,440 @@
+/** @file rpc.h
+ *  @brief Minimal binary RPC transport over stream sockets (Unix-domain or
+ *         TCP). Every message is one frame: a fixed header followed by a
+ *         payload of raw values in the byte order of the host, so both ends
+ *         must share it. Requests carry an id that the reply echoes, so a
+ *         client can keep many requests in flight on one connection and the
+ *         server answers them in order.
+ */
+
+#ifndef D3T_RPC_H
+#define D3T_RPC_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// frames with larger payloads are refused, so a peer cannot have the
+// reader allocate without bound
+constexpr uint32_t RPC_MAX_FRAME_SIZE = (uint32_t)1 << 28;
+
+/*
+ * Header of every frame. Replies have method 0, and requests with id 0 get
+ * no reply.
+ */
+struct RpcHeader {
+    uint32_t size;
+    uint32_t method;
+    uint64_t id;
+};
+
+/*
+ * Appends values to a payload. Vectors and strings are prefixed by their
+ * length.
+ */
+class WireWriter {
+public:
+    template <typename T>
+    void put(T value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "only plain numbers go on the wire");
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    void putVector(const std::vector<T>& values)
+    {
+        static_assert(std::is_arithmetic<T>::value, "only plain numbers go on the wire");
+        put((uint32_t)values.size());
+        const char* bytes = reinterpret_cast<const char*>(values.data());
+        buffer.insert(buffer.end(), bytes, bytes + values.size() * sizeof(T));
+    }
+
+    void putString(const std::string& value)
+    {
+        put((uint32_t)value.size());
+        buffer.insert(buffer.end(), value.begin(), value.end());
+    }
+
+    std::vector<char> buffer;
+};
+
+/*
+ * Reads values back in the order a WireWriter put them. Reading past the
+ * end of the payload gives zeros and empty vectors and strings, and marks
+ * the reader failed, so a truncated or oversized request is caught by
+ * checking done once all of it is read.
+ */
+class WireReader {
+public:
+    explicit WireReader(const std::vector<char>& buffer)
+        : buffer_(buffer), pos_(0), failed_(false)
+    {
+    }
+
+    template <typename T>
+    T get()
+    {
+        static_assert(std::is_arithmetic<T>::value, "only plain numbers go on the wire");
+        T value = 0;
+        const char* bytes = take(sizeof(T));
+        if (bytes != nullptr) {
+            std::memcpy(&value, bytes, sizeof(T));
+        }
+        return value;
+    }
+
+    template <typename T>
+    std::vector<T> getVector()
+    {
+        static_assert(std::is_arithmetic<T>::value, "only plain numbers go on the wire");
+        size_t size = get<uint32_t>();
+        // checked before allocating
+        const char* bytes = size <= remaining() / sizeof(T) ? take(size * sizeof(T)) : fail();
+        if (bytes == nullptr) {
+            return {};
+        }
+        std::vector<T> values(size);
+        std::memcpy(values.data(), bytes, size * sizeof(T));
+        return values;
+    }
+
+    std::string getString()
+    {
+        size_t size = get<uint32_t>();
+        const char* bytes = take(size);
+        return bytes != nullptr ? std::string(bytes, size) : std::string();
+    }
+
+    // whether the whole payload was read, and nothing past it
+    bool done() const
+    {
+        return !failed_ && pos_ == buffer_.size();
+    }
+
+private:
+    size_t remaining() const
+    {
+        return buffer_.size() - pos_;
+    }
+
+    // nullptr, and the reader fails, if fewer than size bytes are left
+    const char* take(size_t size)
+    {
+        if (failed_ || size > remaining()) {
+            return fail();
+        }
+        const char* result = buffer_.data() + pos_;
+        pos_ += size;
+        return result;
+    }
+
+    const char* fail()
+    {
+        failed_ = true;
+        return nullptr;
+    }
+
+    const std::vector<char>& buffer_;
+    size_t pos_;
+    bool failed_;
+};
+
+bool writeFully(int fd, const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool readFully(int fd, void* data, size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t got = ::recv(fd, bytes, size, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+/*
+ * Header and payload in one write, so that frames of concurrent writers
+ * serialized by a mutex never interleave.
+ */
+bool writeFrame(int fd, uint32_t method, uint64_t id, const std::vector<char>& payload)
+{
+    RpcHeader header{(uint32_t)payload.size(), method, id};
+    std::vector<char> frame(sizeof(header) + payload.size());
+    std::memcpy(frame.data(), &header, sizeof(header));
+    std::copy(payload.begin(), payload.end(), frame.begin() + sizeof(header));
+    return writeFully(fd, frame.data(), frame.size());
+}
+
+/*
+ * False if the connection ended or the frame is over RPC_MAX_FRAME_SIZE, in
+ * which case the connection should be dropped.
+ */
+bool readFrame(int fd, RpcHeader& header, std::vector<char>& payload)
+{
+    if (!readFully(fd, &header, sizeof(header))) {
+        return false;
+    }
+    if (header.size > RPC_MAX_FRAME_SIZE) {
+        WARNING_PRINTF("Refusing a frame of %u bytes\n", header.size);
+        return false;
+    }
+    payload.resize(header.size);
+    return readFully(fd, payload.data(), payload.size());
+}
+
+namespace rpc_detail {
+
+sockaddr_un unixAddress(const std::string& path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    assert(path.size() < sizeof(addr.sun_path));
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+addrinfo* tcpAddresses(const std::string& address, bool passive)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        WARNING_PRINTF("Address %s is neither unix:<path> nor <host>:<port>\n",
+                       address.c_str());
+        return nullptr;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo* result = nullptr;
+    int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (err != 0) {
+        WARNING_PRINTF("Cannot resolve %s: %s\n", address.c_str(), gai_strerror(err));
+        return nullptr;
+    }
+    return result;
+}
+
+// requests are small, so do not let Nagle hold them back
+void setNoDelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+} // namespace rpc_detail
+
+/*
+ * Addresses are "unix:<path>" for Unix-domain sockets and "<host>:<port>"
+ * for TCP. Returns -1 on failure, as does listenSocket.
+ */
+int connectSocket(const std::string& address)
+{
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr = rpc_detail::unixAddress(address.substr(5));
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            WARNING_PRINTF("Cannot connect to %s: %s\n", address.c_str(), strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo* addrs = rpc_detail::tcpAddresses(address, false);
+    int fd = -1;
+    for (addrinfo* addr = addrs; addr != nullptr && fd < 0; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addrs != nullptr) {
+        freeaddrinfo(addrs);
+    }
+    if (fd < 0) {
+        WARNING_PRINTF("Cannot connect to %s: %s\n", address.c_str(), strerror(errno));
+        return -1;
+    }
+    rpc_detail::setNoDelay(fd);
+    return fd;
+}
+
+int listenSocket(const std::string& address)
+{
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un addr = rpc_detail::unixAddress(path);
+        unlink(path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+            WARNING_PRINTF("Cannot listen on %s: %s\n", address.c_str(), strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo* addrs = rpc_detail::tcpAddresses(address, true);
+    int fd = -1;
+    for (addrinfo* addr = addrs; addr != nullptr && fd < 0; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        int one = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+                        bind(fd, addr->ai_addr, addr->ai_addrlen) < 0 || listen(fd, 64) < 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addrs != nullptr) {
+        freeaddrinfo(addrs);
+    }
+    if (fd < 0) {
+        WARNING_PRINTF("Cannot listen on %s: %s\n", address.c_str(), strerror(errno));
+    }
+    return fd;
+}
+
+/*
+ * Client end of a connection. Any thread may send; a reader thread hands
+ * each reply to the caller waiting for its id. If the connection drops,
+ * every pending and later call fails with std::runtime_error.
+ */
+class RpcClient {
+public:
+    // takes ownership of fd
+    explicit RpcClient(int fd) : fd_(fd), nextId_(1), closed_(false)
+    {
+        reader_ = std::thread([this] { readLoop(); });
+    }
+
+    RpcClient(const RpcClient&) = delete;
+    RpcClient& operator=(const RpcClient&) = delete;
+
+    ~RpcClient()
+    {
+        shutdown(fd_, SHUT_RDWR);
+        reader_.join();
+        close(fd_);
+    }
+
+    std::future<std::vector<char>> call(uint32_t method, const WireWriter& request)
+    {
+        std::promise<std::vector<char>> reply;
+        std::future<std::vector<char>> result = reply.get_future();
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        uint64_t id = nextId_++;
+        {
+            std::lock_guard<std::mutex> pendingLock(pendingMutex_);
+            if (closed_) {
+                reply.set_exception(
+                    std::make_exception_ptr(std::runtime_error("connection closed")));
+                return result;
+            }
+            pending_.emplace(id, std::move(reply));
+        }
+        // a failed write also ends the reader, which fails the call
+        if (!writeFrame(fd_, method, id, request.buffer)) {
+            shutdown(fd_, SHUT_RDWR);
+        }
+        return result;
+    }
+
+    /*
+     * A request without reply. The server still handles it before any later
+     * request on this connection.
+     */
+    void post(uint32_t method, const WireWriter& request)
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        if (!writeFrame(fd_, method, 0, request.buffer)) {
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+
+private:
+    void readLoop()
+    {
+        RpcHeader header;
+        std::vector<char> payload;
+        while (readFrame(fd_, header, payload)) {
+            std::lock_guard<std::mutex> lock(pendingMutex_);
+            auto it = pending_.find(header.id);
+            if (header.method != 0 || it == pending_.end()) {
+                WARNING_PRINTF("Dropping a connection that sent an unexpected frame\n");
+                shutdown(fd_, SHUT_RDWR);
+                break;
+            }
+            it->second.set_value(std::move(payload));
+            pending_.erase(it);
+        }
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        closed_ = true;
+        for (auto& id2reply : pending_) {
+            id2reply.second.set_exception(
+                std::make_exception_ptr(std::runtime_error("connection closed")));
+        }
+        pending_.clear();
+    }
+
+    int fd_;
+    std::thread reader_;
+    // one frame at a time on the socket
+    std::mutex writeMutex_;
+    uint64_t nextId_;
+    // guards pending_ and closed_
+    std::mutex pendingMutex_;
+    std::unordered_map<uint64_t, std::promise<std::vector<char>>> pending_;
+    bool closed_;
+};
+
+#endif // D3T_RPC_H
@@ -2,54 +2,280 @@
  *  @brief Helper functions including creating entities objects, evaluating a 
  *         decision tree, and a main function that performs the actual 
  *         training task by putting together coordinators and entities.
+ *         runSweep runs many such tasks on one dataset loaded once.
  *
  */
 #ifndef D3T_RUN_HELPERS_H
 #define D3T_RUN_HELPERS_H
 
 #include "coordinator.h"
+#include "dataset_file.h"
 #include "entity.h"
+#include "flat_tree.h"
+#include "model_file.h"
+#include "remote_entity.h"
 #include "split.h"
 #include "utils.h"
+#include <functional>
+#include <mutex>
+#include <sstream>
 #include <thread>
 #include <vector>
 
-std::vector<Entity> createEntities(bool turnOffNoise,
-                                   int seed,
-                                   const std::vector<std::vector<std::vector<float>>>& data,
-                                   const std::vector<std::vector<int>>& labels,
-                                   const std::vector<std::shared_ptr<Split>>& splittingClass,
-                                   std::shared_ptr<SplittingCriterion> splittingCriterion)
+/*
+ * Entities in this process, or each in a child process of its own if
+ * forked, see forkEntities. Entity i owns partitionRows[i] of data, which
+ * all of them share, or streams them from file if given.
+ */
+std::vector<std::shared_ptr<EntityInterface>> createEntities(
+    bool turnOffNoise,
+    int seed,
+    const Dataset& data,
+    const std::vector<std::vector<int>>& partitionRows,
+    const std::vector<std::shared_ptr<Split>>& splittingClass,
+    std::shared_ptr<SplittingCriterion> splittingCriterion,
+    const EntityOptions& options = EntityOptions(),
+    std::shared_ptr<const SplitBitmaps> splitBitmaps = nullptr,
+    std::shared_ptr<const BinnedFeatures> binnedFeatures = nullptr,
+    std::shared_ptr<const DatasetFileReader> file = nullptr,
+    bool forked = false)
 {
-    assert(data.size() == labels.size());
-    std::vector<Entity> result;
-    for (size_t i = 0; i < data.size(); i++) {
-        result.emplace_back(turnOffNoise, i, seed, data[i], labels[i],
-                            splittingClass, splittingCriterion);
+    auto makeEntity = [&](size_t i) {
+        if (file != nullptr) {
+            return std::make_shared<Entity>(turnOffNoise, i, seed, file, partitionRows[i],
+                                            splittingClass, splittingCriterion, options);
+        }
+        return std::make_shared<Entity>(turnOffNoise, i, seed, data, partitionRows[i],
+                                        splittingClass, splittingCriterion, options,
+                                        splitBitmaps, binnedFeatures);
+    };
+    if (forked) {
+        return forkEntities(partitionRows.size(), makeEntity, splittingClass);
+    }
+    std::vector<std::shared_ptr<EntityInterface>> result;
+    for (size_t i = 0; i < partitionRows.size(); i++) {
+        result.push_back(makeEntity(i));
     }
     return result;
 }
 
+/*
+ * Entities served by entity_server processes at addresses (see rpc.h),
+ * entity i by addresses[i % addresses.size()]. Each server loads partition
+ * i, of size partitionSizes[i], on its own; config holds the rest of what
+ * the entities would have been created with here. Returns no entities if
+ * a server cannot be reached or cannot load its entity.
+ */
+std::vector<std::shared_ptr<EntityInterface>> connectEntities(
+    const std::vector<std::string>& addresses,
+    EntityServerConfig config,
+    const std::vector<int>& partitionSizes,
+    const std::vector<std::shared_ptr<Split>>& splittingClass)
+{
+    std::vector<std::shared_ptr<EntityInterface>> result;
+    config.rowEnd = 0;
+    for (size_t i = 0; i < partitionSizes.size(); i++) {
+        const std::string& address = addresses[i % addresses.size()];
+        int fd = connectSocket(address);
+        if (fd < 0) {
+            WARNING_PRINTF("Cannot reach entity server %s\n", address.c_str());
+            return {};
+        }
+        std::shared_ptr<RemoteEntity> entity = std::make_shared<RemoteEntity>(fd, splittingClass);
+        config.entityIdx = (int)i;
+        config.rowBegin = config.rowEnd;
+        config.rowEnd += partitionSizes[i];
+        if (!entity->init(config)) {
+            WARNING_PRINTF("Entity server %s could not load entity %zu\n", address.c_str(), i);
+            return {};
+        }
+        result.push_back(entity);
+    }
+    return result;
+}
+
+std::vector<std::string> splitAddresses(const std::string& addresses)
+{
+    std::vector<std::string> result;
+    std::stringstream stream(addresses);
+    std::string address;
+    while (std::getline(stream, address, ',')) {
+        if (!address.empty()) {
+            result.push_back(address);
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<SplittingCriterion> makeSplittingCriterion(const std::string& name, int numLabels)
+{
+    if (name == "entropy") {
+        return std::make_shared<Entropy>(numLabels);
+    }
+    else if (name == "gini") {
+        return std::make_shared<Gini>(numLabels);
+    }
+    WARNING_PRINTF("Invalid splitting criterion %s\n", name.c_str());
+    assert(false);
+    return nullptr;
+}
+
+// whether makeSplittingCriterion and makeSplittingClass know the names
+bool knownSplittingCriterion(const std::string& name)
+{
+    return name == "entropy" || name == "gini";
+}
+
+bool knownDataset(const std::string& dataset)
+{
+    for (const char* name :
+         {"mnist60k", "mnist100k", "adult", "bank", "creditcard", "skin", "kddcup", "ctr"}) {
+        if (dataset == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::shared_ptr<Split>> makeSplittingClass(const std::string& dataset)
+{
+    if (dataset == "mnist60k" || dataset == "mnist100k") {
+        return ImageBlockSplittingClass(28, 28, 4, 4, 3);
+    }
+    else if (dataset == "adult") {
+        return AdultSplittingClass(10);
+    }
+    else if (dataset == "bank") {
+        return BankSplittingClass();
+    }
+    else if (dataset == "creditcard") {
+        return CreditcardSplittingClass();
+    }
+    else if (dataset == "skin") {
+        return SkinSplittingClass(32);
+    }
+    else if (dataset == "kddcup") {
+        return KDDCupSplittingClass();
+    }
+    else if (dataset == "ctr") {
+        return CTRSplittingClass();
+    }
+    WARNING_PRINTF("Invalid dataset %s\n", dataset.c_str());
+    assert(false);
+    return {};
+}
+
+/*
+ * Split bitmaps depend only on the parsed training set and the splitting
+ * class, so consecutive performTest calls on the same data (e.g. sweeping
+ * over alpha and algo) reuse the last ones built.
+ */
+std::shared_ptr<const SplitBitmaps> cachedSplitBitmaps(
+    const std::string& key,
+    const Dataset& data,
+    const std::vector<std::shared_ptr<Split>>& splittingClass,
+    int numLabels)
+{
+    static std::string cachedKey;
+    static std::shared_ptr<const SplitBitmaps> cached;
+    if (cached == nullptr || cachedKey != key) {
+        cached = std::make_shared<const SplitBitmaps>(data, splittingClass, numLabels);
+        cachedKey = key;
+    }
+    return cached;
+}
+
+/*
+ * Binned features, reused across performTest calls as cachedSplitBitmaps.
+ */
+std::shared_ptr<const BinnedFeatures> cachedBinnedFeatures(
+    const std::string& key,
+    const Dataset& data,
+    const std::vector<std::shared_ptr<Split>>& splittingClass)
+{
+    static std::string cachedKey;
+    static std::shared_ptr<const BinnedFeatures> cached;
+    if (cached == nullptr || cachedKey != key) {
+        cached = std::make_shared<const BinnedFeatures>(data, splittingClass);
+        cachedKey = key;
+    }
+    return cached;
+}
+
+/*
+ * Accuracy of the tree rooted at root on the given rows of data. The tree is
+ * flattened first and the rows are scored in blocks on pool if given.
+ */
 float evaluate(const std::shared_ptr<CoordinatorNode>& root,
-                const std::vector<std::vector<float>>& data,
-                const std::vector<int>& labels)
+               const Dataset& data,
+               const std::vector<int>& rows,
+               ThreadPool* pool = nullptr)
 {
+    FlatTree tree(root);
+    std::vector<int> predictions(rows.size());
+    tree.predictBatch(data, rows.data(), rows.size(), predictions.data(), pool);
     int numCorrect = 0;
-    for (size_t i = 0; i < data.size(); i++) {
-        std::shared_ptr<CoordinatorNode> node = root;
-        while (!node->isLeaf) {
-            int split = node->splitFn->applySplit(data[i]);
-            if (node->children.find(split) == node->children.end()) {
-                INFO_PRINTF("%zu has never been encountered before\n", i);
-                break;
-            }
-            node = node->children[split];
-        }
-        if (node->label == labels[i]) {
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (predictions[i] == data.label(rows[i])) {
             numCorrect++;
         }
     }
-    return (float)numCorrect / data.size();
+    return (float)numCorrect / rows.size();
+}
+
+float evaluate(const std::shared_ptr<CoordinatorNode>& root,
+               const Dataset& data,
+               ThreadPool* pool = nullptr)
+{
+    std::vector<int> rows(data.numRows);
+    for (size_t i = 0; i < data.numRows; i++) {
+        rows[i] = (int)i;
+    }
+    return evaluate(root, data, rows, pool);
+}
+
+/*
+ * Accuracy of the tree rooted at root on the given rows of file, read in
+ * chunks of chunkRows file rows with readAhead chunks read ahead, so that
+ * only one chunk at a time is in memory (see EntityOptions::streamRows).
+ */
+float evaluate(const std::shared_ptr<CoordinatorNode>& root,
+               const std::shared_ptr<const DatasetFileReader>& file,
+               const std::vector<int>& rows,
+               size_t chunkRows,
+               size_t readAhead,
+               ThreadPool* pool = nullptr)
+{
+    FlatTree tree(root);
+    chunkRows = std::max(chunkRows, (size_t)1);
+    std::vector<int> sorted(rows);
+    std::sort(sorted.begin(), sorted.end());
+    // the chunks holding rows, and the rows of each relative to its start
+    std::vector<std::pair<size_t, size_t>> spans;
+    std::vector<std::vector<int>> spanRows;
+    for (int r : sorted) {
+        size_t begin = r / chunkRows * chunkRows;
+        if (spans.empty() || spans.back().first != begin) {
+            spans.push_back({begin, std::min(begin + chunkRows, (size_t)file->header.numRows)});
+            spanRows.emplace_back();
+        }
+        spanRows.back().push_back((int)(r - begin));
+    }
+    RowSpanReader reader(file, spans, readAhead);
+    int numCorrect = 0;
+    std::vector<int> predictions;
+    for (const std::vector<int>& chunkRowIdxs : spanRows) {
+        Dataset chunk = reader.next();
+        predictions.resize(chunkRowIdxs.size());
+        tree.predictBatch(chunk, chunkRowIdxs.data(), chunkRowIdxs.size(), predictions.data(),
+                          pool);
+        for (size_t i = 0; i < chunkRowIdxs.size(); i++) {
+            if (predictions[i] == chunk.label(chunkRowIdxs[i])) {
+                numCorrect++;
+            }
+        }
+    }
+    return (float)numCorrect / rows.size();
 }
 
 class Results {
@@ -59,13 +285,15 @@ public:
             std::string trainingTime,
             std::string evaluationTime,
             int numNodes,
-            int maxAchievedDepth)
+            int maxAchievedDepth,
+            std::shared_ptr<CoordinatorNode> root = nullptr)
         : trainAcc(trainAcc),
           testAcc(testAcc),
           trainingTime(std::move(trainingTime)),
           evaluationTime(std::move(evaluationTime)),
           numNodes(numNodes),
-          maxAchievedDepth(maxAchievedDepth)
+          maxAchievedDepth(maxAchievedDepth),
+          root(std::move(root))
     {
     }
 
@@ -75,34 +303,105 @@ public:
     std::string evaluationTime;
     int numNodes;
     int maxAchievedDepth;
+    // the trained tree, e.g. to save with writeModelFile
+    std::shared_ptr<CoordinatorNode> root;
 };
 
-Results performTest(const std::string& dataset,
-                    float trainingFraction,
-                    int numEntities,
-                    int seed,
-                    const std::string& splittingCriterionName,
-                    float leafPrivacyFraction,
-                    int maxNumNodes,
-                    int maxDepth,
-                    float epsilon,
-                    float alpha,
-                    const std::string& budgetFn,
-                    const std::string& algo)
-{
-    std::vector<std::vector<float>> data, testData;
-    std::vector<int> labels, testLabels;
+/*
+ * A training and test set loaded once for many runs, with what depends only
+ * on them. It is read-only once loaded, so runs on several threads share it.
+ */
+class LoadedDataset {
+public:
+    std::string name;
+    float trainingFraction;
+    int seed;
+    std::string trainPath;
+    // empty if the training rows are streamed from trainFile
+    Dataset data;
+    // the training rows of data (or trainFile), in the order they are
+    // partitioned; all of data unless it was mapped from a dataset file, see
+    // openDataset
+    std::vector<int> rows;
+    Dataset testData;
+    int numLabels;
+    std::vector<std::shared_ptr<Split>> splittingClass;
+    // if EntityOptions::splitBitmaps
+    std::shared_ptr<const SplitBitmaps> splitBitmaps;
+    // if EntityOptions::binnedFeatures
+    std::shared_ptr<const BinnedFeatures> binnedFeatures;
+    // if EntityOptions::streamRows, the dataset file the entities stream
+    std::shared_ptr<const DatasetFileReader> trainFile;
+};
 
-    std::string trainPath = "../data/" + dataset + "_train";
+std::shared_ptr<const LoadedDataset> loadDataset(const std::string& dataset,
+                                                 float trainingFraction,
+                                                 int seed,
+                                                 const EntityOptions& entityOptions)
+{
+    std::shared_ptr<LoadedDataset> result = std::make_shared<LoadedDataset>();
+    result->name = dataset;
+    result->trainingFraction = trainingFraction;
+    result->seed = seed;
+    result->trainPath = "../data/" + dataset + "_train";
     std::string testPath = "../data/" + dataset + "_test";
 
-    int numLabels = parseProtobuf(data, labels, trainPath, seed, trainingFraction);
-    assert(data.size() > 0);
+    if (entityOptions.streamRows) {
+        // the training set may not fit in memory, so it is never loaded
+        result->trainFile =
+            openStreamedDataset(result->rows, result->trainPath, seed, trainingFraction);
+        if (result->trainFile == nullptr) {
+            throw std::runtime_error("streaming needs " + result->trainPath + DATASET_FILE_SUFFIX +
+                                     " with its row-major section");
+        }
+        result->numLabels = result->trainFile->header.numLabels;
+    }
+    else {
+        result->numLabels =
+            openDataset(result->data, result->rows, result->trainPath, seed, trainingFraction);
+    }
+    assert(!result->rows.empty());
+    std::vector<int> testRows;
+    openDataset(result->testData, testRows, testPath, 0, 1.0);
+    result->splittingClass = makeSplittingClass(dataset);
+    std::string key = result->trainPath + "-seed_" + std::to_string(seed) +
+                      "-trainingFraction_" + std::to_string(trainingFraction);
+    if (entityOptions.splitBitmaps && result->trainFile == nullptr) {
+        result->splitBitmaps = cachedSplitBitmaps(key, result->data, result->splittingClass,
+                                                  result->numLabels);
+    }
+    if (entityOptions.binnedFeatures && result->trainFile == nullptr) {
+        result->binnedFeatures = cachedBinnedFeatures(key, result->data, result->splittingClass);
+    }
+    return result;
+}
+
+/*
+ * The parameters of one run on a loaded dataset.
+ */
+class ExperimentConfig {
+public:
+    int numEntities;
+    std::string splittingCriterionName;
+    float leafPrivacyFraction;
+    int maxNumNodes;
+    int maxDepth;
+    float epsilon;
+    float alpha;
+    std::string budgetFn;
+    std::string algo;
+};
 
-    int trainSize = data.size();
-    int numCols = data[0].size();
-    parseProtobuf(testData, testLabels, testPath, 0, 1.0);
-    int testSize = testData.size();
+Results runExperiment(const LoadedDataset& loaded,
+                      const ExperimentConfig& config,
+                      const EntityOptions& entityOptions = EntityOptions(),
+                      const CoordinatorOptions& coordinatorOptions = CoordinatorOptions())
+{
+    const Dataset& data = loaded.data;
+    const Dataset& testData = loaded.testData;
+    int trainSize = loaded.rows.size();
+    int numCols = loaded.trainFile != nullptr ? loaded.trainFile->header.numCols : data.numCols;
+    int testSize = testData.numRows;
     printf(
         "performTest(dataset=%s, "
         "trainingFraction=%f, "
@@ -118,108 +417,95 @@ Results performTest(const std::string& dataset,
         "algo=%s) "
         "with %d cols and %d label types\t%d "
         "trainSize\t%d testSize\n",
-        dataset.c_str(),
-        trainingFraction,
-        numEntities,
-        seed,
-        splittingCriterionName.c_str(),
-        leafPrivacyFraction,
-        maxNumNodes,
-        maxDepth,
-        epsilon,
-        alpha,
-        budgetFn.c_str(),
-        algo.c_str(),
-        numCols, numLabels,
+        loaded.name.c_str(),
+        loaded.trainingFraction,
+        config.numEntities,
+        loaded.seed,
+        config.splittingCriterionName.c_str(),
+        config.leafPrivacyFraction,
+        config.maxNumNodes,
+        config.maxDepth,
+        config.epsilon,
+        config.alpha,
+        config.budgetFn.c_str(),
+        config.algo.c_str(),
+        numCols, loaded.numLabels,
         trainSize, testSize);
 
     std::vector<int> partitionSizes;
-    if (algo == "singleMachine") {
+    if (config.algo == "singleMachine") {
         partitionSizes = {trainSize};
     }
-    else if (algo == "localRNM" || algo == "distributedBaseline") {
-        int entitySize = trainSize / numEntities;
-        int lastEntitySize = trainSize - (numEntities - 1) * entitySize;
-        for (int i = 0; i < numEntities - 1; i++) {
+    else if (config.algo == "localRNM" || config.algo == "distributedBaseline") {
+        int entitySize = trainSize / config.numEntities;
+        int lastEntitySize = trainSize - (config.numEntities - 1) * entitySize;
+        for (int i = 0; i < config.numEntities - 1; i++) {
             partitionSizes.push_back(entitySize);
         }
         partitionSizes.push_back(lastEntitySize);
     }
     else {
-        WARNING_PRINTF("Invalid algo %s\n", algo.c_str());
+        WARNING_PRINTF("Invalid algo %s\n", config.algo.c_str());
         assert(false);
     }
 
-    std::shared_ptr<SplittingCriterion> splittingCriterion;
-    if (splittingCriterionName == "entropy") {
-        splittingCriterion = std::static_pointer_cast<SplittingCriterion>(
-            std::make_shared<Entropy>(numLabels));
-    }
-    else if (splittingCriterionName == "gini") {
-        splittingCriterion = std::static_pointer_cast<SplittingCriterion>(
-            std::make_shared<Gini>(numLabels));
-    }
-    else {
-        WARNING_PRINTF("Invalid splitting criterion %s\n",
-                       splittingCriterionName.c_str());
-        assert(false);
-    }
+    std::shared_ptr<SplittingCriterion> splittingCriterion =
+        makeSplittingCriterion(config.splittingCriterionName, loaded.numLabels);
+    const std::vector<std::shared_ptr<Split>>& splittingClass = loaded.splittingClass;
 
-    std::vector<std::shared_ptr<Split>> splittingClass;
-    if (dataset == "mnist60k" || dataset == "mnist100k") {
-        splittingClass = ImageBlockSplittingClass(28, 28, 4, 4, 3);
-    }
-    else if (dataset == "adult") {
-        splittingClass = AdultSplittingClass(10);
-    }
-    else if (dataset == "bank") {
-        splittingClass = BankSplittingClass();
-    }
-    else if (dataset == "creditcard") {
-        splittingClass = CreditcardSplittingClass();
-    }
-    else if (dataset == "skin") {
-        splittingClass = SkinSplittingClass(32);
-    }
-    else if (dataset == "kddcup") {
-        splittingClass = KDDCupSplittingClass();
-    }
-    else if (dataset == "ctr") {
-        splittingClass = CTRSplittingClass();
+    const std::string& entityServers = coordinatorOptions.entityServers;
+    std::vector<std::shared_ptr<EntityInterface>> entities;
+    if (entityServers.empty() || entityServers == "fork") {
+        entities = createEntities(floatEq(config.alpha, -1), loaded.seed, data,
+                                  partitionRows(loaded.rows, partitionSizes), splittingClass,
+                                  splittingCriterion, entityOptions, loaded.splitBitmaps,
+                                  loaded.binnedFeatures, loaded.trainFile, entityServers == "fork");
     }
     else {
-        WARNING_PRINTF("Invalid dataset %s\n", dataset.c_str());
-        assert(false);
+        EntityServerConfig serverConfig;
+        serverConfig.dataset = loaded.name;
+        serverConfig.seed = loaded.seed;
+        serverConfig.trainingFraction = loaded.trainingFraction;
+        serverConfig.splittingCriterionName = config.splittingCriterionName;
+        serverConfig.turnOffNoise = floatEq(config.alpha, -1);
+        serverConfig.options = entityOptions;
+        entities = connectEntities(splitAddresses(entityServers), serverConfig, partitionSizes,
+                                   splittingClass);
     }
-
-    std::vector<std::vector<std::vector<float>>> entitiesData;
-    std::vector<std::vector<int>> entitiesLabels;
-    std::tie(entitiesData, entitiesLabels) = partitionData(data, labels, partitionSizes);
-    std::vector<Entity> entities =
-        createEntities(floatEq(alpha, -1), seed, entitiesData, entitiesLabels,
-                       splittingClass, splittingCriterion);
-    Coordinator coordinator(leafPrivacyFraction,
-                            maxNumNodes,
-                            maxDepth,
-                            epsilon,
-                            budgetFn,
-                            algo,
+    if (entities.size() != partitionSizes.size()) {
+        throw std::runtime_error("could not start the entities");
+    }
+    // the coordinator may reorder queries when the entities' noise allows it
+    CoordinatorOptions options = coordinatorOptions;
+    options.counterNoise = entityOptions.counterNoise;
+    Coordinator coordinator(config.leafPrivacyFraction,
+                            config.maxNumNodes,
+                            config.maxDepth,
+                            config.epsilon,
+                            config.budgetFn,
+                            config.algo,
                             trainSize,
                             entities,
                             splittingClass,
-                            splittingCriterion);
+                            splittingCriterion,
+                            options);
 
     auto start = std::chrono::high_resolution_clock::now();
     std::shared_ptr<CoordinatorNode> root;
     int numNodes, maxAchievedDepth;
-    std::tie(root, numNodes, maxAchievedDepth) = coordinator.train(alpha);
+    std::tie(root, numNodes, maxAchievedDepth) = coordinator.train(config.alpha);
     auto end = std::chrono::high_resolution_clock::now();
     std::string trainingTime =
         sec2str(std::chrono::duration_cast<std::chrono::seconds>(end - start).count());
 
     start = std::chrono::high_resolution_clock::now();
-    float trainAcc = evaluate(root, data, labels);
-    float testAcc = evaluate(root, testData, testLabels);
+    ThreadPool* pool = coordinator.threadPool().get();
+    float trainAcc = loaded.trainFile != nullptr
+                         ? evaluate(root, loaded.trainFile, loaded.rows,
+                                    entityOptions.streamChunkRows, entityOptions.streamReadAhead,
+                                    pool)
+                         : evaluate(root, data, loaded.rows, pool);
+    float testAcc = evaluate(root, testData, pool);
     end = std::chrono::high_resolution_clock::now();
     std::string evaluationTime =
         sec2str(std::chrono::duration_cast<std::chrono::seconds>(end - start).count());
@@ -229,7 +515,61 @@ Results performTest(const std::string& dataset,
         "time: %s\tNum nodes: %d\tMax achieved depth: %d\n",
         trainAcc, testAcc, trainingTime.c_str(), evaluationTime.c_str(),
         numNodes, maxAchievedDepth);
-    return Results(trainAcc, testAcc, trainingTime, evaluationTime, numNodes, maxAchievedDepth);
+    return Results(trainAcc, testAcc, trainingTime, evaluationTime, numNodes, maxAchievedDepth,
+                   root);
+}
+
+/*
+ * Runs every config on loaded, numThreads at a time (0 for one per core),
+ * and calls onResult with each config and its results as soon as it is
+ * done, one call at a time. Configs are handed out one by one to whichever
+ * thread is free, so cheap and expensive ones balance out. While configs
+ * run side by side, each coordinator queries its entities on one thread.
+ */
+void runSweep(const LoadedDataset& loaded,
+              const std::vector<ExperimentConfig>& configs,
+              int numThreads,
+              const EntityOptions& entityOptions,
+              CoordinatorOptions coordinatorOptions,
+              const std::function<void(const ExperimentConfig&, const Results&)>& onResult)
+{
+    // forking is only safe from a process with a single thread
+    if (coordinatorOptions.entityServers == "fork" && numThreads != 1) {
+        WARNING_PRINTF("Forked entities run one config at a time\n");
+        numThreads = 1;
+    }
+    ThreadPool pool(numThreads);
+    if (pool.numThreads() > 1) {
+        coordinatorOptions.numThreads = 1;
+    }
+    std::mutex resultMutex;
+    pool.parallelFor(configs.size(), [&](size_t i) {
+        Results results = runExperiment(loaded, configs[i], entityOptions, coordinatorOptions);
+        std::lock_guard<std::mutex> lock(resultMutex);
+        onResult(configs[i], results);
+    });
+}
+
+Results performTest(const std::string& dataset,
+                    float trainingFraction,
+                    int numEntities,
+                    int seed,
+                    const std::string& splittingCriterionName,
+                    float leafPrivacyFraction,
+                    int maxNumNodes,
+                    int maxDepth,
+                    float epsilon,
+                    float alpha,
+                    const std::string& budgetFn,
+                    const std::string& algo,
+                    const EntityOptions& entityOptions = EntityOptions(),
+                    const CoordinatorOptions& coordinatorOptions = CoordinatorOptions())
+{
+    std::shared_ptr<const LoadedDataset> loaded =
+        loadDataset(dataset, trainingFraction, seed, entityOptions);
+    ExperimentConfig config{numEntities, splittingCriterionName, leafPrivacyFraction,
+                            maxNumNodes, maxDepth, epsilon, alpha, budgetFn, algo};
+    return runExperiment(*loaded, config, entityOptions, coordinatorOptions);
 }
 
 #endif // D3T_RUN_HELPERS_H
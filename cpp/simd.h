@@ -0,0 +1,374 @@
+/** @file simd.h
+ *  @brief Batch kernels for evaluating splits over many rows at once, and the
+ *         log used to score them, with AVX2 and AVX-512 versions picked at
+ *         runtime and a scalar fallback.
+ *         All versions add attributes in the same order as the scalar code,
+ *         so they produce exactly the same branches.
+ */
+
+#ifndef D3T_SIMD_H
+#define D3T_SIMD_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define D3T_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+enum class SimdLevel { Scalar = 0, AVX2 = 1, AVX512 = 2 };
+
+/*
+ * Best instruction set supported by this CPU. Setting the environment
+ * variable SIMD_LEVEL to scalar/avx2/avx512 caps it, e.g. for testing.
+ */
+inline SimdLevel detectSimdLevel()
+{
+    SimdLevel level = SimdLevel::Scalar;
+#ifdef D3T_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        level = SimdLevel::AVX512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        level = SimdLevel::AVX2;
+    }
+#endif
+    const char* requested = getenv("SIMD_LEVEL");
+    if (requested != NULL) {
+        SimdLevel cap = SimdLevel::AVX512;
+        if (strcmp(requested, "scalar") == 0) {
+            cap = SimdLevel::Scalar;
+        }
+        else if (strcmp(requested, "avx2") == 0) {
+            cap = SimdLevel::AVX2;
+        }
+        if (cap < level) {
+            level = cap;
+        }
+    }
+    return level;
+}
+
+inline SimdLevel simdLevel()
+{
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+/*
+ * out[i] = (sum over c of columns[c][rows[i]]) <= scaledThreshold
+ * The threshold kernels take FixedColumns > 0 when the number of columns is
+ * known at compile time (e.g. single attribute splits), 0 otherwise.
+ */
+template <size_t FixedColumns>
+inline void thresholdBatchScalar(const float* const* columns,
+                                 size_t numColumns,
+                                 float scaledThreshold,
+                                 const int* rows,
+                                 size_t n,
+                                 uint8_t* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        float sum = 0.0;
+        for (size_t c = 0; c < (FixedColumns > 0 ? FixedColumns : numColumns); c++) {
+            sum += columns[c][rows[i]];
+        }
+        out[i] = sum <= scaledThreshold;
+    }
+}
+
+/*
+ * out[i] = y <= m * x + b, where x and y are the averages of xColumns and
+ * yColumns at rows[i]
+ */
+inline void obliqueBatchScalar(const float* const* xColumns,
+                               size_t numXColumns,
+                               const float* const* yColumns,
+                               size_t numYColumns,
+                               float m,
+                               float b,
+                               const int* rows,
+                               size_t n,
+                               uint8_t* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        float x = 0.0;
+        float y = 0.0;
+        for (size_t c = 0; c < numXColumns; c++) {
+            x += xColumns[c][rows[i]];
+        }
+        x = x / numXColumns;
+        for (size_t c = 0; c < numYColumns; c++) {
+            y += yColumns[c][rows[i]];
+        }
+        y = y / numYColumns;
+        out[i] = y <= m * x + b;
+    }
+}
+
+/*
+ * Natural log of positive, normal floats with the Cephes logf polynomial.
+ * Every version performs the same float operations in the same order, and
+ * never an FMA, so they agree bit for bit.
+ */
+constexpr float LOG_SQRTHF = 0.707106781186547524f;
+constexpr float LOG_POLY[9] = {7.0376836292E-2f,  -1.1514610310E-1f, 1.1676998740E-1f,
+                               -1.2420140846E-1f, 1.4249322787E-1f,  -1.6668057665E-1f,
+                               2.0000714765E-1f,  -2.4999993993E-1f, 3.3333331174E-1f};
+constexpr float LOG_Q1 = -2.12194440e-4f;
+constexpr float LOG_Q2 = 0.693359375f;
+
+inline void logBatchScalar(const float* in, size_t n, float* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        // in[i] = x * 2^e with x in [0.5, 1)
+        uint32_t bits;
+        std::memcpy(&bits, in + i, sizeof(float));
+        float e = (float)((int)(bits >> 23) - 126);
+        bits = (bits & 0x007FFFFF) | 0x3F000000;
+        float x;
+        std::memcpy(&x, &bits, sizeof(float));
+        // move x into [sqrt(1/2) - 1, sqrt(2) - 1)
+        bool small = x < LOG_SQRTHF;
+        float tmp = small ? x : 0.0f;
+        x = x - 1.0f;
+        e = small ? e - 1.0f : e;
+        x = x + tmp;
+        float z = x * x;
+        float y = LOG_POLY[0];
+        for (int k = 1; k < 9; k++) {
+            y = y * x;
+            y = y + LOG_POLY[k];
+        }
+        y = y * x;
+        y = y * z;
+        y = y + e * LOG_Q1;
+        y = y - z * 0.5f;
+        x = x + y;
+        out[i] = x + e * LOG_Q2;
+    }
+}
+
+#ifdef D3T_X86_SIMD
+// AVX2 kernels are built without FMA so m * x + b is never contracted
+template <size_t FixedColumns>
+__attribute__((target("avx2"))) inline void thresholdBatchAVX2(const float* const* columns,
+                                                               size_t numColumns,
+                                                               float scaledThreshold,
+                                                               const int* rows,
+                                                               size_t n,
+                                                               uint8_t* out)
+{
+    const __m256 threshold = _mm256_set1_ps(scaledThreshold);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i*)(rows + i));
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t c = 0; c < (FixedColumns > 0 ? FixedColumns : numColumns); c++) {
+            sum = _mm256_add_ps(sum, _mm256_i32gather_ps(columns[c], idx, 4));
+        }
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(sum, threshold, _CMP_LE_OQ));
+        for (int k = 0; k < 8; k++) {
+            out[i + k] = (mask >> k) & 1;
+        }
+    }
+    thresholdBatchScalar<FixedColumns>(columns, numColumns, scaledThreshold, rows + i, n - i,
+                                       out + i);
+}
+
+__attribute__((target("avx2"))) inline void obliqueBatchAVX2(const float* const* xColumns,
+                                                             size_t numXColumns,
+                                                             const float* const* yColumns,
+                                                             size_t numYColumns,
+                                                             float m,
+                                                             float b,
+                                                             const int* rows,
+                                                             size_t n,
+                                                             uint8_t* out)
+{
+    const __m256 mv = _mm256_set1_ps(m);
+    const __m256 bv = _mm256_set1_ps(b);
+    const __m256 numX = _mm256_set1_ps((float)numXColumns);
+    const __m256 numY = _mm256_set1_ps((float)numYColumns);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_loadu_si256((const __m256i*)(rows + i));
+        __m256 x = _mm256_setzero_ps();
+        __m256 y = _mm256_setzero_ps();
+        for (size_t c = 0; c < numXColumns; c++) {
+            x = _mm256_add_ps(x, _mm256_i32gather_ps(xColumns[c], idx, 4));
+        }
+        x = _mm256_div_ps(x, numX);
+        for (size_t c = 0; c < numYColumns; c++) {
+            y = _mm256_add_ps(y, _mm256_i32gather_ps(yColumns[c], idx, 4));
+        }
+        y = _mm256_div_ps(y, numY);
+        __m256 line = _mm256_add_ps(_mm256_mul_ps(mv, x), bv);
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(y, line, _CMP_LE_OQ));
+        for (int k = 0; k < 8; k++) {
+            out[i + k] = (mask >> k) & 1;
+        }
+    }
+    obliqueBatchScalar(xColumns, numXColumns, yColumns, numYColumns, m, b, rows + i, n - i,
+                       out + i);
+}
+
+template <size_t FixedColumns>
+__attribute__((target("avx512f"))) inline void thresholdBatchAVX512(const float* const* columns,
+                                                                    size_t numColumns,
+                                                                    float scaledThreshold,
+                                                                    const int* rows,
+                                                                    size_t n,
+                                                                    uint8_t* out)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 threshold = _mm512_set1_ps(scaledThreshold);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_loadu_si512((const void*)(rows + i));
+        __m512 sum = zero;
+        for (size_t c = 0; c < (FixedColumns > 0 ? FixedColumns : numColumns); c++) {
+            sum = _mm512_add_ps(sum, _mm512_mask_i32gather_ps(zero, 0xFFFF, idx, columns[c], 4));
+        }
+        __mmask16 mask = _mm512_cmp_ps_mask(sum, threshold, _CMP_LE_OQ);
+        _mm512_mask_cvtepi32_storeu_epi8(out + i, 0xFFFF, _mm512_maskz_set1_epi32(mask, 1));
+    }
+    thresholdBatchScalar<FixedColumns>(columns, numColumns, scaledThreshold, rows + i, n - i,
+                                       out + i);
+}
+
+// the explicitly rounded mul/add keep the compiler from fusing them into an FMA
+__attribute__((target("avx512f"))) inline void obliqueBatchAVX512(const float* const* xColumns,
+                                                                  size_t numXColumns,
+                                                                  const float* const* yColumns,
+                                                                  size_t numYColumns,
+                                                                  float m,
+                                                                  float b,
+                                                                  const int* rows,
+                                                                  size_t n,
+                                                                  uint8_t* out)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 mv = _mm512_set1_ps(m);
+    const __m512 bv = _mm512_set1_ps(b);
+    const __m512 numX = _mm512_set1_ps((float)numXColumns);
+    const __m512 numY = _mm512_set1_ps((float)numYColumns);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i idx = _mm512_loadu_si512((const void*)(rows + i));
+        __m512 x = zero;
+        __m512 y = zero;
+        for (size_t c = 0; c < numXColumns; c++) {
+            x = _mm512_add_ps(x, _mm512_mask_i32gather_ps(zero, 0xFFFF, idx, xColumns[c], 4));
+        }
+        x = _mm512_div_ps(x, numX);
+        for (size_t c = 0; c < numYColumns; c++) {
+            y = _mm512_add_ps(y, _mm512_mask_i32gather_ps(zero, 0xFFFF, idx, yColumns[c], 4));
+        }
+        y = _mm512_div_ps(y, numY);
+        __m512 mx = _mm512_mask_mul_round_ps(zero, 0xFFFF, mv, x,
+                                             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 line = _mm512_mask_add_round_ps(zero, 0xFFFF, mx, bv,
+                                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __mmask16 mask = _mm512_cmp_ps_mask(y, line, _CMP_LE_OQ);
+        _mm512_mask_cvtepi32_storeu_epi8(out + i, 0xFFFF, _mm512_maskz_set1_epi32(mask, 1));
+    }
+    obliqueBatchScalar(xColumns, numXColumns, yColumns, numYColumns, m, b, rows + i, n - i,
+                       out + i);
+}
+__attribute__((target("avx2"))) inline void logBatchAVX2(const float* in, size_t n, float* out)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 sqrthf = _mm256_set1_ps(LOG_SQRTHF);
+    const __m256i mantissa = _mm256_set1_epi32(0x007FFFFF);
+    const __m256i half = _mm256_set1_epi32(0x3F000000);
+    const __m256i bias = _mm256_set1_epi32(126);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i bits = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias));
+        __m256 x = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, mantissa), half));
+        __m256 small = _mm256_cmp_ps(x, sqrthf, _CMP_LT_OQ);
+        __m256 tmp = _mm256_and_ps(x, small);
+        x = _mm256_sub_ps(x, one);
+        e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+        x = _mm256_add_ps(x, tmp);
+        __m256 z = _mm256_mul_ps(x, x);
+        __m256 y = _mm256_set1_ps(LOG_POLY[0]);
+        for (int k = 1; k < 9; k++) {
+            y = _mm256_mul_ps(y, x);
+            y = _mm256_add_ps(y, _mm256_set1_ps(LOG_POLY[k]));
+        }
+        y = _mm256_mul_ps(y, x);
+        y = _mm256_mul_ps(y, z);
+        y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q1)));
+        y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+        x = _mm256_add_ps(x, y);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(x, _mm256_mul_ps(e, _mm256_set1_ps(LOG_Q2))));
+    }
+    logBatchScalar(in + i, n - i, out + i);
+}
+#endif
+
+template <size_t FixedColumns>
+inline void thresholdBatch(const float* const* columns,
+                           size_t numColumns,
+                           float scaledThreshold,
+                           const int* rows,
+                           size_t n,
+                           uint8_t* out)
+{
+#ifdef D3T_X86_SIMD
+    switch (simdLevel()) {
+    case SimdLevel::AVX512:
+        return thresholdBatchAVX512<FixedColumns>(columns, numColumns, scaledThreshold, rows, n, out);
+    case SimdLevel::AVX2:
+        return thresholdBatchAVX2<FixedColumns>(columns, numColumns, scaledThreshold, rows, n, out);
+    default:
+        break;
+    }
+#endif
+    thresholdBatchScalar<FixedColumns>(columns, numColumns, scaledThreshold, rows, n, out);
+}
+
+inline void obliqueBatch(const float* const* xColumns,
+                         size_t numXColumns,
+                         const float* const* yColumns,
+                         size_t numYColumns,
+                         float m,
+                         float b,
+                         const int* rows,
+                         size_t n,
+                         uint8_t* out)
+{
+#ifdef D3T_X86_SIMD
+    switch (simdLevel()) {
+    case SimdLevel::AVX512:
+        return obliqueBatchAVX512(xColumns, numXColumns, yColumns, numYColumns, m, b, rows, n,
+                                  out);
+    case SimdLevel::AVX2:
+        return obliqueBatchAVX2(xColumns, numXColumns, yColumns, numYColumns, m, b, rows, n,
+                                out);
+    default:
+        break;
+    }
+#endif
+    obliqueBatchScalar(xColumns, numXColumns, yColumns, numYColumns, m, b, rows, n, out);
+}
+
+// there is no AVX-512 log kernel, AVX-512 machines use the AVX2 one
+inline void logBatch(const float* in, size_t n, float* out)
+{
+#ifdef D3T_X86_SIMD
+    if (simdLevel() >= SimdLevel::AVX2) {
+        return logBatchAVX2(in, n, out);
+    }
+#endif
+    logBatchScalar(in, n, out);
+}
+
+#endif // D3T_SIMD_H
@@ -88,6 +88,74 @@ int main() { // int argc, char *argv[], char *envp[]) {
     float leafPrivacyFraction = std::stof(leafPrivacyFraction_s);
     std::cout << "got leaf privacy fraction = " << leafPrivacyFraction << std::endl;
 
+    // optional performance settings, these do not change the results
+    EntityOptions entityOptions;
+    CoordinatorOptions coordinatorOptions;
+    const char *splitBitmaps_c = getenv("SPLIT_BITMAPS");
+    if (splitBitmaps_c != NULL) {
+        entityOptions.splitBitmaps = std::stoi(std::string(splitBitmaps_c)) != 0;
+    }
+    std::cout << "got split bitmaps = " << entityOptions.splitBitmaps << std::endl;
+    const char *binnedFeatures_c = getenv("BINNED_FEATURES");
+    if (binnedFeatures_c != NULL) {
+        entityOptions.binnedFeatures = std::stoi(std::string(binnedFeatures_c)) != 0;
+    }
+    std::cout << "got binned features = " << entityOptions.binnedFeatures << std::endl;
+    const char *tensorCacheMB_c = getenv("TENSOR_CACHE_MB");
+    if (tensorCacheMB_c != NULL) {
+        entityOptions.tensorCacheBytes = std::stoul(std::string(tensorCacheMB_c)) << 20;
+    }
+    std::cout << "got tensor cache bytes = " << entityOptions.tensorCacheBytes << std::endl;
+    const char *streamRows_c = getenv("STREAM_ROWS");
+    if (streamRows_c != NULL) {
+        entityOptions.streamRows = std::stoi(std::string(streamRows_c)) != 0;
+    }
+    std::cout << "got stream rows = " << entityOptions.streamRows << std::endl;
+    const char *streamChunkRows_c = getenv("STREAM_CHUNK_ROWS");
+    if (streamChunkRows_c != NULL) {
+        entityOptions.streamChunkRows = std::stoul(std::string(streamChunkRows_c));
+    }
+    std::cout << "got stream chunk rows = " << entityOptions.streamChunkRows << std::endl;
+    const char *streamReadAhead_c = getenv("STREAM_READ_AHEAD");
+    if (streamReadAhead_c != NULL) {
+        entityOptions.streamReadAhead = std::stoul(std::string(streamReadAhead_c));
+    }
+    std::cout << "got stream read ahead = " << entityOptions.streamReadAhead << std::endl;
+    const char *numThreads_c = getenv("NUM_THREADS");
+    if (numThreads_c != NULL) {
+        coordinatorOptions.numThreads = std::stoi(std::string(numThreads_c));
+    }
+    std::cout << "got num threads = " << coordinatorOptions.numThreads << std::endl;
+    const char *prefetchChildren_c = getenv("PREFETCH_CHILDREN");
+    if (prefetchChildren_c != NULL) {
+        coordinatorOptions.prefetchChildren = std::stoi(std::string(prefetchChildren_c)) != 0;
+    }
+    std::cout << "got prefetch children = " << coordinatorOptions.prefetchChildren << std::endl;
+    const char *entityServers_c = getenv("ENTITY_SERVERS");
+    if (entityServers_c != NULL) {
+        coordinatorOptions.entityServers = std::string(entityServers_c);
+    }
+    std::cout << "got entity servers = " << coordinatorOptions.entityServers << std::endl;
+
+    // optional settings that change the results
+    const char *splitCountsFromLabels_c = getenv("SPLIT_COUNTS_FROM_LABELS");
+    if (splitCountsFromLabels_c != NULL) {
+        coordinatorOptions.splitCountsFromLabelCounts =
+            std::stoi(std::string(splitCountsFromLabels_c)) != 0;
+    }
+    std::cout << "got split counts from label counts = "
+              << coordinatorOptions.splitCountsFromLabelCounts << std::endl;
+    const char *counterNoise_c = getenv("COUNTER_NOISE");
+    if (counterNoise_c != NULL) {
+        entityOptions.counterNoise = std::stoi(std::string(counterNoise_c)) != 0;
+    }
+    std::cout << "got counter noise = " << entityOptions.counterNoise << std::endl;
+    const char *levelWise_c = getenv("LEVEL_WISE");
+    if (levelWise_c != NULL) {
+        coordinatorOptions.levelWise = std::stoi(std::string(levelWise_c)) != 0;
+    }
+    std::cout << "got level wise = " << coordinatorOptions.levelWise << std::endl;
+
     std::string csvPath = "dataset_" + dataset + \
                           "-seed_" + seed_s + \
                           "-trainingFraction_" + trainingFraction_s + \
@@ -116,6 +184,25 @@ int main() { // int argc, char *argv[], char *envp[]) {
                "numNodes,"
                "maxAchievedDepth\n";
 
+    const char *sweepThreads_c = getenv("SWEEP_THREADS");
+    int sweepThreads = 1;
+    if (sweepThreads_c != NULL) {
+        sweepThreads = std::stoi(std::string(sweepThreads_c));
+    }
+    std::cout << "got sweep threads = " << sweepThreads << std::endl;
+
+    // where to save the trained trees, if anywhere
+    const char *modelDirectory_c = getenv("MODEL_DIRECTORY");
+    std::string modelDirectory;
+    if (modelDirectory_c != NULL) {
+        modelDirectory = std::string(modelDirectory_c);
+    }
+    std::cout << "got model directory = " << modelDirectory << std::endl;
+    // set once a tree could not be saved, e.g. to a missing directory,
+    // after which no more are attempted
+    bool modelWriteFailed = false;
+
+    std::vector<ExperimentConfig> configs;
     for (int numEntity : numEntities) {
         for (const std::string &splittingCriterionName : splittingCriterionNames) {
             for (int maxNumNode : maxNumNodes) {
@@ -123,11 +210,8 @@ int main() { // int argc, char *argv[], char *envp[]) {
                     for (float eps : epsilons) {
                         for (float alpha : alphas) {
                             for (const std::string &algo : algos) {
-                                Results r = performTest(
-                                        dataset,
-                                        trainingFraction,
+                                configs.push_back(ExperimentConfig{
                                         numEntity,
-                                        seed,
                                         splittingCriterionName,
                                         leafPrivacyFraction,
                                         maxNumNode,
@@ -135,26 +219,7 @@ int main() { // int argc, char *argv[], char *envp[]) {
                                         eps,
                                         alpha,
                                         budgetFn,
-                                        algo);
-                                myfile_ << dataset 
-                                        << "," << trainingFraction 
-                                        << "," << numEntity
-                                        << "," << seed 
-                                        << "," << splittingCriterionName
-                                        << "," << leafPrivacyFraction 
-                                        << "," << maxNumNode 
-                                        << "," << maxDepth 
-                                        << "," << eps
-                                        << "," << alpha 
-                                        << "," << budgetFn 
-                                        << "," << algo
-                                        << "," << r.trainAcc 
-                                        << "," << r.testAcc 
-                                        << "," << r.trainingTime
-                                        << "," << r.evaluationTime
-                                        << "," << r.numNodes 
-                                        << "," << r.maxAchievedDepth
-                                        << std::endl;
+                                        algo});
                             }
                         }
                     }
@@ -162,5 +227,55 @@ int main() { // int argc, char *argv[], char *envp[]) {
             }
         }
     }
+
+    // parsed once for all configs, and rows are written as configs finish
+    std::shared_ptr<const LoadedDataset> loaded =
+        loadDataset(dataset, trainingFraction, seed, entityOptions);
+    runSweep(*loaded, configs, sweepThreads, entityOptions, coordinatorOptions,
+             [&](const ExperimentConfig &config, const Results &r) {
+                 myfile_ << dataset
+                         << "," << trainingFraction
+                         << "," << config.numEntities
+                         << "," << seed
+                         << "," << config.splittingCriterionName
+                         << "," << config.leafPrivacyFraction
+                         << "," << config.maxNumNodes
+                         << "," << config.maxDepth
+                         << "," << config.epsilon
+                         << "," << config.alpha
+                         << "," << config.budgetFn
+                         << "," << config.algo
+                         << "," << r.trainAcc
+                         << "," << r.testAcc
+                         << "," << r.trainingTime
+                         << "," << r.evaluationTime
+                         << "," << r.numNodes
+                         << "," << r.maxAchievedDepth
+                         << std::endl;
+                 if (!modelDirectory.empty() && !modelWriteFailed) {
+                     std::ostringstream modelPath;
+                     modelPath << modelDirectory << "/dataset_" << dataset
+                               << "-seed_" << seed_s
+                               << "-numEntities_" << config.numEntities
+                               << "-criterion_" << config.splittingCriterionName
+                               << "-maxNumNodes_" << config.maxNumNodes
+                               << "-maxDepth_" << config.maxDepth
+                               << "-eps_" << config.epsilon
+                               << "-alpha_" << config.alpha
+                               << "-algo_" << config.algo;
+                     FlatTree tree(r.root);
+                     std::string modelFilePath = modelPath.str() + MODEL_FILE_SUFFIX;
+                     bool written = writeModelFile(tree, modelFilePath);
+                     // only trees of threshold splits have a source form
+                     if (written && tree.kernels.empty()) {
+                         written = writeModelSource(tree, modelPath.str() + ".cpp", "predict");
+                     }
+                     if (!written) {
+                         WARNING_PRINTF("Could not save the model %s, not saving the other trees\n",
+                                        modelFilePath.c_str());
+                         modelWriteFailed = true;
+                     }
+                 }
+             });
 }
 
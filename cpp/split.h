@@ -6,9 +6,14 @@
 #ifndef D3T_SPLIT_H
 #define D3T_SPLIT_H
 
+#include "simd.h"
 #include "utils.h"
+#include <algorithm>
 #include <cmath>
+#include <memory>
+#include <typeinfo>
 #include <unordered_map>
+#include <variant>
 #include <vector>
 
 class Split {
@@ -21,6 +26,27 @@ public:
 
     virtual ~Split() = default;
     virtual int applySplit(const std::vector<float>& datum) const = 0;
+
+    /*
+     * Applies split to row of data. Splits that only read a few attributes
+     * should override this to read the columns they need.
+     */
+    virtual int applySplit(const Dataset& data, size_t row) const
+    {
+        return applySplit(data.rowVector(row));
+    }
+
+    /*
+     * Applies split to rows[0..n) of data and writes the branch of each row
+     * to out. Subclasses override this with vectorized kernels.
+     */
+    virtual void applySplitBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const
+    {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (uint8_t)applySplit(data, rows[i]);
+        }
+    }
+
     virtual std::string toString() const = 0;
 
     std::vector<int> labels;
@@ -28,6 +54,20 @@ public:
     inline static int globalCounter = 0;
 };
 
+/*
+ * The number of branches splitFn's counts are kept for, 0..its largest
+ * label. This is more than labels.size() if some branch has no label, and
+ * every count tensor of the split must use it.
+ */
+int splitBranches(const std::shared_ptr<Split>& splitFn)
+{
+    int numBranches = 0;
+    for (int label : splitFn->labels) {
+        numBranches = std::max(numBranches, label + 1);
+    }
+    return numBranches;
+}
+
 class ThresholdSplit : public Split {
 public:
     ThresholdSplit(const std::vector<int>& attributes, float threshold)
@@ -35,6 +75,8 @@ public:
     {
     }
 
+    using Split::applySplit;
+
     /*
      * applies split over the average of attributes for threshold
      */
@@ -47,6 +89,25 @@ public:
         return sum <= threshold * attributes.size();
     }
 
+    int applySplit(const Dataset& data, size_t row) const override
+    {
+        float sum = 0.0;
+        for (size_t i = 0; i < attributes.size(); i++) {
+            sum += data.at(row, attributes[i]);
+        }
+        return sum <= threshold * attributes.size();
+    }
+
+    void applySplitBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const override
+    {
+        std::vector<const float*> columns;
+        for (int attr : attributes) {
+            columns.push_back(data.column(attr));
+        }
+        thresholdBatch<0>(columns.data(), columns.size(), threshold * attributes.size(), rows, n,
+                          out);
+    }
+
     std::string toString() const override
     {
         std::string result;
@@ -71,6 +132,8 @@ public:
     {
     }
 
+    using Split::applySplit;
+
     int applySplit(const std::vector<float>& datum) const override
     {
         float x = 0.0;
@@ -86,6 +149,34 @@ public:
         return y <= m * x + b;
     }
 
+    int applySplit(const Dataset& data, size_t row) const override
+    {
+        float x = 0.0;
+        float y = 0.0;
+        for (int xAttr : xs) {
+            x += data.at(row, xAttr);
+        }
+        x = x / xs.size();
+        for (int yAttr : ys) {
+            y += data.at(row, yAttr);
+        }
+        y = y / ys.size();
+        return y <= m * x + b;
+    }
+
+    void applySplitBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const override
+    {
+        std::vector<const float*> xColumns, yColumns;
+        for (int xAttr : xs) {
+            xColumns.push_back(data.column(xAttr));
+        }
+        for (int yAttr : ys) {
+            yColumns.push_back(data.column(yAttr));
+        }
+        obliqueBatch(xColumns.data(), xColumns.size(), yColumns.data(), yColumns.size(), m, b,
+                     rows, n, out);
+    }
+
     std::string toString() const override
     {
         return "";
@@ -96,6 +187,119 @@ public:
     float b;
 };
 
+/*
+ * Closed set of kernels for the splits built in this file. A split is
+ * converted once with makeSplitKernel, and hot loops then dispatch once per
+ * batch of rows into a monomorphic, inlinable kernel. Any other Split
+ * subclass goes through its virtual interface via CustomSplitKernel.
+ */
+class SingleThresholdKernel {
+public:
+    int apply(const Dataset& data, size_t row) const
+    {
+        return data.at(row, attribute) <= threshold;
+    }
+
+    void applyBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const
+    {
+        const float* column = data.column(attribute);
+        thresholdBatch<1>(&column, 1, threshold, rows, n, out);
+    }
+
+    int attribute;
+    float threshold;
+};
+
+class AverageThresholdKernel {
+public:
+    int apply(const Dataset& data, size_t row) const
+    {
+        float sum = 0.0;
+        for (int attr : attributes) {
+            sum += data.at(row, attr);
+        }
+        return sum <= scaledThreshold;
+    }
+
+    void applyBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const
+    {
+        std::vector<const float*> columns;
+        for (int attr : attributes) {
+            columns.push_back(data.column(attr));
+        }
+        thresholdBatch<0>(columns.data(), columns.size(), scaledThreshold, rows, n, out);
+    }
+
+    std::vector<int> attributes;
+    // threshold * attributes.size(), compared against the sum
+    float scaledThreshold;
+};
+
+class ObliqueKernel {
+public:
+    int apply(const Dataset& data, size_t row) const
+    {
+        return split->ObliqueSplit::applySplit(data, row);
+    }
+
+    void applyBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const
+    {
+        split->ObliqueSplit::applySplitBatch(data, rows, n, out);
+    }
+
+    const ObliqueSplit* split;
+};
+
+class CustomSplitKernel {
+public:
+    int apply(const Dataset& data, size_t row) const
+    {
+        return split->applySplit(data, row);
+    }
+
+    void applyBatch(const Dataset& data, const int* rows, size_t n, uint8_t* out) const
+    {
+        split->applySplitBatch(data, rows, n, out);
+    }
+
+    const Split* split;
+};
+
+using SplitKernel =
+    std::variant<SingleThresholdKernel, AverageThresholdKernel, ObliqueKernel, CustomSplitKernel>;
+
+/*
+ * The kernel keeps a raw pointer for oblique and custom splits, so splitFn
+ * must outlive it.
+ */
+SplitKernel makeSplitKernel(const std::shared_ptr<Split>& splitFn)
+{
+    // exact type checks, subclasses may override applySplit
+    if (typeid(*splitFn) == typeid(ThresholdSplit)) {
+        const ThresholdSplit& split = static_cast<const ThresholdSplit&>(*splitFn);
+        if (split.attributes.size() == 1) {
+            return SingleThresholdKernel{split.attributes[0], split.threshold};
+        }
+        return AverageThresholdKernel{split.attributes,
+                                      split.threshold * split.attributes.size()};
+    }
+    if (typeid(*splitFn) == typeid(ObliqueSplit)) {
+        return ObliqueKernel{static_cast<const ObliqueSplit*>(splitFn.get())};
+    }
+    return CustomSplitKernel{splitFn.get()};
+}
+
+inline int applySplitKernel(const SplitKernel& kernel, const Dataset& data, size_t row)
+{
+    return std::visit([&](const auto& k) { return k.apply(data, row); }, kernel);
+}
+
+inline void applySplitKernelBatch(
+    const SplitKernel& kernel, const Dataset& data, const int* rows, size_t n, uint8_t* out)
+{
+    std::visit([&](const auto& k) { k.applyBatch(data, rows, n, out); }, kernel);
+}
+
 void addContinuous(std::vector<std::shared_ptr<Split>>& splittingClass,
                    const std::vector<int>& attributes,
                    float low,
@@ -397,6 +601,11 @@ std::vector<std::shared_ptr<Split>> CTRSplittingClass() {
 }
 
 
+/*
+ * Scores label counts given as dense arrays, counts[label] for label <
+ * numLabels. Labels with count 0 are left out, as if the node had no such
+ * label, so an all-zero array scores like an empty node.
+ */
 class SplittingCriterion {
 public:
     SplittingCriterion(int numLabels) : numLabels(numLabels)
@@ -405,14 +614,17 @@ public:
 
     virtual ~SplittingCriterion() = default;
 
-    virtual float calcG(std::unordered_map<int, float>& counts) = 0;
-    virtual float calcG(std::unordered_map<int, int>& counts)
+    /*
+     * out[i] = G of counts[i * numLabels .. (i + 1) * numLabels), for i < n.
+     * Scoring many count arrays in one call lets the criterion vectorize.
+     */
+    virtual void calcGBatch(const float* counts, size_t n, float* out) const = 0;
+
+    float calcG(const float* counts) const
     {
-        std::unordered_map<int, float> input;
-        for (auto& label2count : counts) {
-            input.insert({label2count.first, (float)label2count.second});
-        }
-        return calcG(input);
+        float result;
+        calcGBatch(counts, 1, &result);
+        return result;
     }
 
     virtual float sensitivity(int totalSize) = 0;
@@ -422,22 +634,39 @@ public:
 
 class Entropy : public SplittingCriterion {
 public:
-    Entropy(int numLabels) : SplittingCriterion(numLabels)
+    Entropy(int numLabels) : SplittingCriterion(numLabels), invLogNumLabels(1.0 / log(numLabels))
     {
     }
 
-    float calcG(std::unordered_map<int, float>& counts) override
+    void calcGBatch(const float* counts, size_t n, float* out) const override
     {
-        float result = 0.0;
-        float total = 0.0;
-        for (auto& label2count : counts) {
-            total += label2count.second;
+        size_t size = n * numLabels;
+        std::vector<float> probs(size);
+        // log(1) = 0 stands in for the labels that are left out
+        std::vector<float> logInputs(size, 1.0);
+        for (size_t i = 0; i < n; i++) {
+            const float* row = counts + i * numLabels;
+            float total = 0.0;
+            for (int label = 0; label < numLabels; label++) {
+                total += row[label];
+            }
+            for (int label = 0; label < numLabels; label++) {
+                if (row[label] > 0) {
+                    probs[i * numLabels + label] = row[label] / total;
+                    logInputs[i * numLabels + label] = probs[i * numLabels + label];
+                }
+            }
         }
-        for (auto& label2count : counts) {
-            float p = label2count.second / total;
-            result -= p * log(p) / log(numLabels);
+        std::vector<float> logs(size);
+        logBatch(logInputs.data(), size, logs.data());
+        for (size_t i = 0; i < n; i++) {
+            float result = 0.0;
+            for (int label = 0; label < numLabels; label++) {
+                result -= probs[i * numLabels + label] * logs[i * numLabels + label] *
+                          invLogNumLabels;
+            }
+            out[i] = result;
         }
-        return result;
     }
 
     float sensitivity(int m) override
@@ -446,6 +675,8 @@ public:
         float numSplitLabels = 2;
         return numSplitLabels / m + (float)numLabels * log(m) / m * (numSplitLabels + 1);
     }
+
+    const float invLogNumLabels;
 };
 
 class Gini : public SplittingCriterion {
@@ -454,18 +685,23 @@ public:
     {
     }
 
-    float calcG(std::unordered_map<int, float>& counts) override
+    void calcGBatch(const float* counts, size_t n, float* out) const override
     {
-        float total = 0.0;
-        for (auto& label2count : counts) {
-            total += label2count.second;
-        }
-        float result = 1.0;
-        for (auto& label2count : counts) {
-            float p = label2count.second / total;
-            result -= p * p;
+        for (size_t i = 0; i < n; i++) {
+            const float* row = counts + i * numLabels;
+            float total = 0.0;
+            for (int label = 0; label < numLabels; label++) {
+                total += row[label];
+            }
+            float result = 1.0;
+            for (int label = 0; label < numLabels; label++) {
+                if (row[label] > 0) {
+                    float p = row[label] / total;
+                    result -= p * p;
+                }
+            }
+            out[i] = result;
         }
-        return result;
     }
 
     float sensitivity(int m) override
@@ -0,0 +1,152 @@
+/** @file thread_pool.h
+ *  @brief Persistent pool of worker threads for fanning a loop out over
+ *         independent tasks, e.g. one query per entity. The calling thread
+ *         takes tasks too and returns once every task is done.
+ */
+
+#ifndef D3T_THREAD_POOL_H
+#define D3T_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    /*
+     * numThreads counts the calling thread, so numThreads - 1 workers are
+     * started; 0 means one thread per hardware thread.
+     */
+    explicit ThreadPool(int numThreads)
+    {
+        if (numThreads <= 0) {
+            numThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < numThreads - 1; i++) {
+            workers_.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeup_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    int numThreads() const
+    {
+        return (int)workers_.size() + 1;
+    }
+
+    /*
+     * Calls fn(i) for every i < n and returns when all calls are done. Tasks
+     * run in any order and on any thread, so fn(i) must only touch state of
+     * task i. Calls from inside a task run serially on the calling thread.
+     */
+    void parallelFor(size_t n, const std::function<void(size_t)>& fn)
+    {
+        if (workers_.empty() || n <= 1 || insideTask()) {
+            for (size_t i = 0; i < n; i++) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(submitMutex_);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // workers that woke late for the previous loop must be out of it
+            done_.wait(lock, [this] { return busy_ == 0; });
+            fn_ = &fn;
+            n_ = n;
+            next_ = 0;
+            remaining_ = n;
+            generation_++;
+        }
+        wakeup_.notify_all();
+
+        insideTask() = true;
+        runTasks(fn, n);
+        insideTask() = false;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return remaining_ == 0 && busy_ == 0; });
+        fn_ = nullptr;
+    }
+
+private:
+    static bool& insideTask()
+    {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+    void workerLoop()
+    {
+        insideTask() = true;
+        size_t seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wakeup_.wait(lock, [&] { return stop_ || generation_ != seenGeneration; });
+            if (stop_) {
+                return;
+            }
+            seenGeneration = generation_;
+            if (fn_ == nullptr) {
+                continue;
+            }
+            const std::function<void(size_t)>& fn = *fn_;
+            size_t n = n_;
+            busy_++;
+            lock.unlock();
+            runTasks(fn, n);
+            lock.lock();
+            busy_--;
+            if (busy_ == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    void runTasks(const std::function<void(size_t)>& fn, size_t n)
+    {
+        size_t i;
+        while ((i = next_.fetch_add(1)) < n) {
+            fn(i);
+            if (remaining_.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    // one parallelFor at a time
+    std::mutex submitMutex_;
+    // guards everything below except the atomics
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable done_;
+    bool stop_ = false;
+    size_t generation_ = 0;
+    const std::function<void(size_t)>* fn_ = nullptr;
+    size_t n_ = 0;
+    int busy_ = 0;
+    std::atomic<size_t> next_{0};
+    std::atomic<size_t> remaining_{0};
+};
+
+#endif // D3T_THREAD_POOL_H
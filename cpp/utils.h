@@ -5,10 +5,12 @@
 #ifndef D3T_UTILS_H
 #define D3T_UTILS_H
 
+#include <algorithm>
 #include <fstream>
 #include <random>
 
 #include "../third_party/protobuf/dataset.pb.h"
+#include "dataset.h"
 
 #define WARNING_PRINTF(fmt, args...) \
     fprintf(stdout, "WARNING: %s:%d:%s: " fmt, __FILE__, __LINE__, __func__, ##args)
@@ -33,25 +35,21 @@ bool floatEq(float a, float b)
 }
 
 /*
- * Partition up (data, labels) into parts with size specified by partitionSizes
+ * Partition up rows, the rows of a dataset in the order they are used, into
+ * consecutive parts with size specified by partitionSizes. Each part is
+ * sorted, as entities need their rows in increasing order.
  */
-std::tuple<std::vector<std::vector<std::vector<float>>>, std::vector<std::vector<int>>> partitionData(
-    const std::vector<std::vector<float>>& data,
-    const std::vector<int>& labels,
-    const std::vector<int>& partitionSizes)
+std::vector<std::vector<int>> partitionRows(const std::vector<int>& rows,
+                                            const std::vector<int>& partitionSizes)
 {
-    std::vector<std::vector<std::vector<float>>> partitionData;
-    std::vector<std::vector<int>> partitionLabels;
-    int acc = 0;
+    std::vector<std::vector<int>> partitions;
+    size_t acc = 0;
     for (int partitionSize : partitionSizes) {
-        std::vector<std::vector<float>> dataSlice(
-            data.begin() + acc, data.begin() + acc + partitionSize);
-        std::vector<int> labelSlice(labels.begin() + acc, labels.begin() + acc + partitionSize);
-        partitionData.push_back(dataSlice);
-        partitionLabels.push_back(labelSlice);
+        partitions.emplace_back(rows.begin() + acc, rows.begin() + acc + partitionSize);
+        std::sort(partitions.back().begin(), partitions.back().end());
         acc += partitionSize;
     }
-    return std::make_tuple(partitionData, partitionLabels);
+    return partitions;
 }
 
 std::string sec2str(int secs)
@@ -110,62 +108,87 @@ void shuffleData(int seed, std::vector<std::vector<float>>& data, std::vector<in
 }
 
 /*
-Returns the number of distinct labels_.
+ * The rows of a dataset of numRows rows that a run with seed and training
+ * fraction uses, in the order it uses them: the first numRows * fraction of
+ * a random permutation.
+ */
+std::vector<size_t> sampleRows(size_t numRows, int seed, float fraction)
+{
+    size_t getNumRows = (size_t) (numRows * fraction);
+    if (getNumRows > numRows) {
+        std::cout << "getNumRows: " << getNumRows << " is larger than numRows: " << numRows << std::endl;
+        std::cout << "defaulting to numRows" << std::endl;
+        getNumRows = numRows;
+    }
+
+    // create a random permutation
+    std::mt19937 rng(seed);
+    std::vector<size_t> randIdx;
+    for (size_t i = 0; i < numRows; i++) {
+        randIdx.push_back(i);
+    }
+    shuffle(randIdx.begin(), randIdx.end(), rng);
+    randIdx.resize(getNumRows);
+    return randIdx;
+}
+
+/*
+Returns the number of distinct labels_. Unless shuffle is false, which keeps
+the rows in file order, data holds the rows sampleRows picks.
 */
-size_t parseProtobuf(std::vector<std::vector<float>>& data,
-                     std::vector<int>& labels,
+size_t parseProtobuf(Dataset& data,
                      const std::string& fp,
                      int seed,
-                     float fraction)
+                     float fraction,
+                     bool shuffle = true)
 {
-    protoDataset::Dataset myData;
+    // freed once the sampled rows are copied out, see below
+    std::unique_ptr<protoDataset::Dataset> myData(new protoDataset::Dataset());
     std::fstream input(fp, std::ios::in | std::ios::binary);
     if (!input) {
         std::cerr << fp << " not found!" << std::endl;
         return 0;
     }
-    else if (!myData.ParseFromIstream(&input)) {
+    else if (!myData->ParseFromIstream(&input)) {
         std::cerr << "failed to parse" << fp << std::endl;
         return 0;
     }
-    size_t numCols = myData.numcols();
-    size_t numRows = myData.numrows();
-    size_t numLabels = myData.numlabels();
-    if (myData.data().size() != (int)(numCols*numRows)) {
-        std::cerr << "data size: " << myData.data().size() << " numCols * numRows: " << (numCols*numRows) << std::endl;
+    size_t numCols = myData->numcols();
+    size_t numRows = myData->numrows();
+    size_t numLabels = myData->numlabels();
+    if (myData->data().size() != (int)(numCols*numRows)) {
+        std::cerr << "data size: " << myData->data().size() << " numCols * numRows: " << (numCols*numRows) << std::endl;
         assert(false);
     }
 
-    size_t getNumRows = (size_t) (numRows * fraction);
-    if (getNumRows > numRows) {
-        std::cout << "getNumRows: " << getNumRows << " is larger than numRows: " << numRows << std::endl;
-        std::cout << "defaulting to numRows" << std::endl;
-        getNumRows = numRows;
-    }
-
-    // create a random permutation
-    std::mt19937 rng(seed);
-    std::vector<size_t> randIdx;
-    for (size_t i = 0; i < numRows; i++) {
-        randIdx.push_back(i);
+    std::vector<size_t> randIdx = sampleRows(numRows, seed, fraction);
+    size_t getNumRows = randIdx.size();
+    if (!shuffle) {
+        for (size_t r = 0; r < getNumRows; r++) {
+            randIdx[r] = r;
+        }
     }
-    shuffle(randIdx.begin(), randIdx.end(), rng);
 
-    // use the first getNumRow's number of the permutation as data
+    // use the first getNumRow's number of the permutation as data; only the
+    // row-major layout is filled while the message is alive, and the
+    // column-major one is built after it is freed, so the features are held
+    // at most twice at a time
+    std::shared_ptr<float> rowMajor = allocateAligned<float>(getNumRows * numCols);
+    std::shared_ptr<int> labels = allocateAligned<int>(getNumRows);
     for (size_t r = 0; r < getNumRows; r++) {
         size_t idx = randIdx[r];
-        std::vector<float> myRow = std::vector<float>();
-        copy(myData.data().begin() + idx * numCols,
-             myData.data().begin() + (idx + 1) * numCols, back_inserter(myRow));
-        data.push_back(myRow);
-        labels.push_back(myData.labels().Get(idx));
+        std::memcpy(rowMajor.get() + r * numCols, myData->data().data() + idx * numCols,
+                    numCols * sizeof(float));
+        labels.get()[r] = myData->labels().Get(idx);
     }
+    myData.reset();
+    data = Dataset(getNumRows, numCols, std::move(rowMajor), std::move(labels));
 
     printf(
         "Successfully parsed %lu x %lu data_ and %lu labels_! There are %lu "
         "distinct labels_ \n",
-        data.size(), data[0].size(), labels.size(), numLabels);
-    assert(data.size() == labels.size() && data.size() == getNumRows && data[0].size() == numCols);
+        data.numRows, data.numCols, data.numRows, numLabels);
+    assert(data.numRows == getNumRows && data.numCols == numCols);
     return numLabels;
 }
 